@@ -0,0 +1,250 @@
+/*
+	Ahead-of-time translation of PM/0 code into a standalone C program.
+	Each instruction becomes straight-line C on a local stack array and
+	every jump a goto. A RET or RTN goes through one switch over the return
+	sites of the program's CALs. Outer frames are reached through static
+	links, which the VM keeps in every AR alongside its display.
+
+	The program takes the driver's -b and -B flags and does SIO exactly
+	like the VM in each mode. Every push, CAL and INC checks the stack
+	size: arguments and expression temporaries sit on the caller's stack
+	above its locals, and the callee's parameters are reached below its AR.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+
+/*
+	Runtime every translation starts with. The helpers after it are
+	written only when the code uses them, so the output builds quietly
+	with -Wall.
+*/
+static const char * const prelude =
+	"#include <stdio.h>\n"
+	"#include <stdlib.h>\n"
+	"#include <string.h>\n"
+	"\n"
+	"static int stack[STACK_SIZE + STACK_REACH];\n"
+	"static int io;\n"
+	"\n";
+
+static const char * const frame_fn =
+	"static int frame(const int *s, unsigned b, int l)\n"
+	"{\n"
+	"\tfor(; l > 0; l--) b = s[b + 1];\n"
+	"\treturn b;\n"
+	"}\n"
+	"\n";
+
+static const char * const sio_write_fn =
+	"static void sio_write(int v)\n"
+	"{\n"
+	"\tif(io == 2) fwrite(&v, sizeof(v), 1, stdout);\n"
+	"\telse printf(\"%d\\n\", v);\n"
+	"}\n"
+	"\n";
+
+static const char * const sio_read_fn =
+	"static int input_done;\n"
+	"\n"
+	"// Past the end of batch input, reads give 0\n"
+	"static void sio_read(int *cell)\n"
+	"{\n"
+	"\tif(io == 0)\n"
+	"\t{\n"
+	"\t\tprintf(\"Input an integer value: \");\n"
+	"\t\tif(scanf(\"%d\", cell) < 0) return;\n"
+	"\t}\n"
+	"\telse if(input_done || (io == 2 ? fread(cell, sizeof(*cell), 1, stdin) != 1 : scanf(\"%d\", cell) != 1))\n"
+	"\t{\n"
+	"\t\tinput_done = 1;\n"
+	"\t\t*cell = 0;\n"
+	"\t}\n"
+	"}\n"
+	"\n";
+
+static const char * const main_start =
+	"static void overflow(void)\n"
+	"{\n"
+	"\tfflush(stdout);\n"
+	"\tfprintf(stderr, \"Error: Stack overflow (%u cells)\\n\", STACK_SIZE);\n"
+	"\texit(1);\n"
+	"}\n"
+	"\n"
+	"int main(int argc, char **argv)\n"
+	"{\n"
+	"\tint *s = stack;\n"
+	"\tunsigned sp = 0, bp = 1;\n"
+	"\tint i;\n";
+
+static const char * const main_args =
+	"\n"
+	"\tfor(i = 1; i < argc; i++)\n"
+	"\t{\n"
+	"\t\tif(strcmp(argv[i], \"-b\") == 0) io = 1;\n"
+	"\t\telse if(strcmp(argv[i], \"-B\") == 0) io = 2;\n"
+	"\t}\n"
+	"\tif(io) setvbuf(stdout, NULL, _IOFBF, 1 << 16);\n"
+	"\n";
+
+static const char * const oprs[14] = {
+	NULL, NULL, "+", "-", "*", "/", NULL, "%", "==", "!=", "<", "<=", ">", ">="
+};
+
+// C expression for the base of the AR l static links out
+static const char *base_expr(char *buf, size_t size, int l)
+{
+	if(l == 0) return "bp";
+	if(l == 1) return "s[bp + 1]";
+	snprintf(buf, size, "frame(s, bp, %d)", l);
+	return buf;
+}
+
+// Label for a jump to t; anything outside the code ends the program like the VM
+static int label(int t, int code_len)
+{
+	return (t < 0 || t > code_len) ? code_len : t;
+}
+
+static void write_opr(FILE *out, int m)
+{
+	switch(m)
+	{
+		case 0: // RET
+			fprintf(out, "\tsp = bp - 1; pc = s[sp + 4]; bp = s[sp + 3]; goto ret;\n");
+			break;
+		case 1: // NEG, wrapping like the VM
+			fprintf(out, "\ts[sp] = -(unsigned) s[sp];\n");
+			break;
+		case 6: // ODD
+			fprintf(out, "\ts[sp] %%= 2;\n");
+			break;
+		case 2: case 3: case 4:
+			fprintf(out, "\tsp--; s[sp] = (unsigned) s[sp] %s (unsigned) s[sp + 1];\n", oprs[m]);
+			break;
+		case 5: case 7:
+			fprintf(out, "\tsp--; s[sp] %s= s[sp + 1];\n", oprs[m]);
+			break;
+		default:
+			fprintf(out, "\tsp--; s[sp] = s[sp] %s s[sp + 1];\n", oprs[m]);
+			break;
+	}
+}
+
+/*
+	Write code as C; returns 0 on failure. stack_size is rounded up to
+	whole pages like the VM's stack. Pushes are checked against it, and
+	the array has room past it for a new AR and for the cells a STO 0 m
+	of hand-written code may place above sp.
+*/
+int aot_write_c(FILE *out, const int (*code)[3], int code_len, unsigned stack_size,
+	const ModuleProc *procs, int num_procs)
+{
+	char *target, buf[32];
+	int i, k, l, m, reach = 0, has_ret = 0, has_frame = 0, has_write = 0, has_read = 0;
+
+	if(!stack_size) stack_size = DEFAULT_STACK_HEIGHT;
+	stack_size = (stack_size + 1023) / 1024 * 1024;
+
+	if(!(target = calloc(code_len + 1, 1)))
+		return 0;
+
+	// Only jump targets and return sites get labels
+	for(i = 0; i < code_len; i++)
+	{
+		l = code[i][1];
+		m = code[i][2];
+
+		// Links two or more levels out are walked by frame()
+		if((code[i][0] == 3 || code[i][0] == 4 || code[i][0] == 5) && l >= 2) has_frame = 1;
+
+		switch(code[i][0])
+		{
+			case 4: if(l == 0 && m > reach) reach = m; break;
+			case 5: target[label(m, code_len)] = 1; target[i + 1] = 1; break;
+			case 7: case 8: target[label(m, code_len)] = 1; break;
+			case 2: if(m == 0) has_ret = 1; break;
+			case RTN: has_ret = 1; break;
+			case 9: if(m == 1) has_write = 1; else if(m == 2) has_read = 1; break;
+		}
+	}
+
+	fprintf(out, "/* Generated from PM/0 code; build with cc -O2 */\n");
+	fprintf(out, "#define STACK_SIZE %uu\n", stack_size);
+	fprintf(out, "#define STACK_REACH %d\n\n", reach + 5);
+	fputs(prelude, out);
+	if(has_frame) fputs(frame_fn, out);
+	if(has_write) fputs(sio_write_fn, out);
+	if(has_read) fputs(sio_read_fn, out);
+	fputs(main_start, out);
+	if(has_ret) fputs("\tunsigned pc;\n", out);
+	fputs(main_args, out);
+
+	for(i = 0; i < code_len; i++)
+	{
+		l = code[i][1];
+		m = code[i][2];
+
+		for(k = 0; k < num_procs; k++)
+			if(procs[k].adr == i) fprintf(out, "\t/* %.*s */\n", (int) sizeof(procs[k].name), procs[k].name);
+
+		if(target[i]) fprintf(out, "L%d:\n", i);
+
+		switch(code[i][0])
+		{
+			case 1: // LIT
+				fprintf(out, "\tif(++sp >= STACK_SIZE) overflow();\n");
+				fprintf(out, "\ts[sp] = %d;\n", m);
+				break;
+			case 2: // OPR
+				write_opr(out, m);
+				break;
+			case 3: // LOD
+				fprintf(out, "\tif(sp + 1 >= STACK_SIZE) overflow();\n");
+				fprintf(out, "\ts[sp + 1] = s[%s + %d]; sp++;\n", base_expr(buf, sizeof(buf), l), m);
+				break;
+			case 4: // STO
+				fprintf(out, "\ts[%s + %d] = s[sp--];\n", base_expr(buf, sizeof(buf), l), m);
+				break;
+			case 5: // CAL
+				fprintf(out, "\tif(sp + 4 >= STACK_SIZE) overflow();\n");
+				fprintf(out, "\ts[sp + 1] = 0; s[sp + 2] = %s; s[sp + 3] = bp; s[sp + 4] = %d;\n",
+					base_expr(buf, sizeof(buf), l), i + 1);
+				fprintf(out, "\tbp = sp + 1; goto L%d;\n", label(m, code_len));
+				break;
+			case 6: // INC
+				fprintf(out, "\tsp += %d; if(sp >= STACK_SIZE) overflow();\n", m);
+				break;
+			case 7: // JMP
+				fprintf(out, "\tgoto L%d;\n", label(m, code_len));
+				break;
+			case 8: // JPC
+				fprintf(out, "\tif(s[sp--] == 0) goto L%d;\n", label(m, code_len));
+				break;
+			case RTN: // The value replaces the m arguments
+				fprintf(out, "\tpc = s[bp + 3]; sp = bp - %d; s[sp] = s[bp]; bp = s[bp + 2]; goto ret;\n", m);
+				break;
+			case 9: // SIO
+				if(m == 1) fprintf(out, "\tsio_write(s[sp--]);\n");
+				else if(m == 2) fprintf(out, "\tif(++sp >= STACK_SIZE) overflow();\n\tsio_read(&s[sp]);\n");
+				else if(m == 3) fprintf(out, "\tgoto L%d;\n", code_len);
+				break;
+		}
+	}
+
+	// Return sites; a return address outside them stops the run
+	if(has_ret)
+	{
+		fprintf(out, "\tgoto L%d;\nret:\n\tswitch(pc)\n\t{\n", code_len);
+		for(i = 0; i < code_len; i++)
+			if(code[i][0] == 5) fprintf(out, "\t\tcase %d: goto L%d;\n", i + 1, i + 1);
+		fprintf(out, "\t}\n");
+	}
+
+	fprintf(out, "L%d:\n\tfflush(stdout);\n\treturn 0;\n}\n", code_len);
+	free(target);
+	return !ferror(out);
+}
@@ -0,0 +1,11 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdio.h>
+
+#include "module.h"
+
+int aot_write_c(FILE *out, const int (*code)[3], int code_len, unsigned stack_size,
+	const ModuleProc *procs, int num_procs);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+	Runs many compiled programs (modules or vminput.txt text) concurrently, one VM
+	instance per program. Programs are dealt round-robin onto per-worker
+	deques; a worker pops from the bottom of its own deque and, once that
+	is empty, steals from the top of the others.
+
+	Output of prog goes to prog.out; SIO reads come from prog.in if it
+	exists and hit end of input otherwise. -b and -B select the batch
+	text and raw int32 I/O modes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "module.h"
+
+#define MAX_WORKERS 64
+
+typedef struct Deque {
+	pthread_mutex_t lock;
+	int *jobs;
+	int top;		// Next job a thief takes
+	int bottom;		// One past the next job the owner takes
+} Deque;
+
+typedef struct Worker {
+	pthread_t thread;
+	int id;
+	int done;		// Programs run
+	int stolen;		// Of those, taken from another worker
+	int failed;
+	unsigned long long steps;
+} Worker;
+
+static char **files;
+static int engine = DEFAULT_ENGINE;
+static int fusion;
+static int io = IO_INTERACTIVE;
+static int num_workers = 1;
+static Deque deques[MAX_WORKERS];
+
+// Owner end; returns -1 when the deque is empty
+static int pop_bottom(Deque *d)
+{
+	int job = -1;
+
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top) job = d->jobs[--d->bottom];
+	pthread_mutex_unlock(&d->lock);
+	return job;
+}
+
+// Thief end; returns -1 when the deque is empty
+static int steal_top(Deque *d)
+{
+	int job = -1;
+
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top) job = d->jobs[d->top++];
+	pthread_mutex_unlock(&d->lock);
+	return job;
+}
+
+// Jobs never spawn jobs, so a full sweep of empty deques means we are done
+static int next_job(Worker *w)
+{
+	int i, job;
+
+	if((job = pop_bottom(&deques[w->id])) >= 0)
+		return job;
+
+	for(i = 1; i < num_workers; i++)
+	{
+		if((job = steal_top(&deques[(w->id + i) % num_workers])) >= 0)
+		{
+			w->stolen++;
+			return job;
+		}
+	}
+	return -1;
+}
+
+// Binary modules are mapped; anything else is read as text
+static int is_module(FILE *fp)
+{
+	char magic[4];
+	int n = fread(magic, 1, 4, fp);
+
+	rewind(fp);
+	return n == 4 && memcmp(magic, MODULE_MAGIC, 4) == 0;
+}
+
+// Load and run one program; returns 0 on failure
+static int run_program(Worker *w, const char *path)
+{
+	char name[FILENAME_MAX];
+	FILE *code, *in, *out;
+	VM *vm;
+	int ok = 0;
+
+	if(!(code = fopen(path, "r")))
+	{
+		fprintf(stderr, "Error: Could not open %s\n", path);
+		return 0;
+	}
+
+	if(!(vm = vm_create()))
+	{
+		fclose(code);
+		return 0;
+	}
+
+	vm->engine = engine;
+	vm->fusion = fusion;
+	vm->io = io;
+
+	snprintf(name, sizeof(name), "%s.in", path);
+	in = fopen(name, "rb");
+	if(!in) in = fopen("/dev/null", "rb");
+
+	snprintf(name, sizeof(name), "%s.out", path);
+	out = fopen(name, "wb");
+
+	if(!in || !out)
+		fprintf(stderr, "Error: Could not open I/O files for %s\n", path);
+	else if(is_module(code) ? vm_load_module(vm, path) : vm_load(vm, code))
+	{
+		vm->in = in;
+		vm->out = out;
+		vm_run(vm, NULL);
+		w->steps += vm->steps;
+		ok = 1;
+	}
+	else fprintf(stderr, "Error: Could not load %s\n", path);
+
+	if(in) fclose(in);
+	if(out) fclose(out);
+	fclose(code);
+	vm_destroy(vm);
+	return ok;
+}
+
+static void *worker_main(void *arg)
+{
+	Worker *w = arg;
+	int job;
+
+	while((job = next_job(w)) >= 0)
+	{
+		if(!run_program(w, files[job])) w->failed++;
+		w->done++;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	Worker workers[MAX_WORKERS];
+	char started[MAX_WORKERS];
+	unsigned long long steps = 0;
+	int i, n, num_files, failed = 0;
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i++)
+	{
+		if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) num_workers = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-f") == 0) fusion = 1;
+		else if(strcmp(argv[i], "-b") == 0) io = IO_BUFFERED;
+		else if(strcmp(argv[i], "-B") == 0) io = IO_RAW;
+		else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+		{
+			if((engine = engine_by_name(argv[++i])) < 0)
+			{
+				printf("Unknown engine: %s\n", argv[i]);
+				return 0;
+			}
+		}
+		else printf("Invalid argument: %s\n", argv[i]);
+	}
+
+	files = &argv[i];
+	num_files = argc - i;
+
+	if(num_files < 1)
+	{
+		printf("USAGE: ./batch [-j workers] [-e engine] [-f] [-b | -B] [program files]\n");
+		return 0;
+	}
+
+	if(num_workers < 1) num_workers = 1;
+	if(num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+	if(num_workers > num_files) num_workers = num_files;
+
+	// Deal the programs round-robin; each deque can hold all of them
+	for(i = 0; i < num_workers; i++)
+	{
+		pthread_mutex_init(&deques[i].lock, NULL);
+		deques[i].jobs = malloc(num_files * sizeof(int));
+		deques[i].top = deques[i].bottom = 0;
+	}
+
+	for(n = 0; n < num_files; n++)
+	{
+		Deque *d = &deques[n % num_workers];
+		d->jobs[d->bottom++] = n;
+	}
+
+	for(i = 0; i < num_workers; i++)
+	{
+		memset(&workers[i], 0, sizeof(Worker));
+		workers[i].id = i;
+		started[i] = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) == 0;
+	}
+
+	// Any worker that could not be started runs on this thread instead
+	for(i = 0; i < num_workers; i++)
+		if(!started[i]) worker_main(&workers[i]);
+
+	for(i = 0; i < num_workers; i++)
+	{
+		if(started[i]) pthread_join(workers[i].thread, NULL);
+		steps += workers[i].steps;
+		failed += workers[i].failed;
+		printf("Worker %d: %d programs (%d stolen)\n", i, workers[i].done, workers[i].stolen);
+	}
+
+	printf("%d programs, %d failed, %llu instructions executed\n", num_files, failed, steps);
+
+	for(i = 0; i < MAX_WORKERS && deques[i].jobs; i++)
+	{
+		pthread_mutex_destroy(&deques[i].lock);
+		free(deques[i].jobs);
+	}
+
+	return failed == 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Times every bench/*.txt program at each cell width on the threaded engine.
+# Output differing from the 32-bit run means the program overflowed the narrower cells.
+# usage: cells.sh driver repeat
+
+driver=$(realpath "$1")
+repeat=$2
+dir=$(mktemp -d)
+
+cd "$(dirname "$0")"
+
+printf '%-12s%-8s%-12s%s\n' "Program" "Cells" "Seconds" "Output"
+
+for f in *.txt; do
+	name=${f%.txt}
+	cp "$f" "$dir/in.txt"
+	expected=$(cd "$dir" && "$driver" -n -b -e threaded < /dev/null | tail -n 1)
+
+	for bits in 16 32 64; do
+		result=$(cd "$dir" && "$driver" -n -b -e threaded -w "$bits" < /dev/null 2>&1 | tail -n 1)
+
+		# Best wall time of repeat runs, compile included
+		best=
+		for ((i = 0; i < repeat; i++)); do
+			start=$EPOCHREALTIME
+			(cd "$dir" && "$driver" -n -b -e threaded -w "$bits" < /dev/null > /dev/null 2>&1)
+			end=$EPOCHREALTIME
+			best=$(awk -v s="$start" -v e="$end" -v b="$best" 'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+		done
+
+		[ "$result" = "$expected" ] && match=same || match="differs ($result)"
+		printf '%-12s%-8s%-12.6f%s\n' "$name" "$bits" "$best" "$match"
+	done
+done
+
+rm -rf "$dir"
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Writes a generated PL/0 program of about the given size to stdout:
+# straight-line statements and comments over a few variables and a procedure.
+# With a width, an indented block comment of about that many bytes leads every 16 statements.
+# usage: gen.sh megabytes [width]
+
+awk -v bytes=$(($1 * 1048576)) -v width=${2:-0} 'BEGIN {
+	print "var a, b, c, total;"
+	print "procedure step(x, y);"
+	print "\tvar t;"
+	print "\tbegin t := x * 3 - y; return := t / 2 end;"
+	print "begin"
+	print "\ta := 1; b := 2; c := 3; total := 0;"
+	n = 150
+	for (i = 0; n < bytes; i++) {
+		line = sprintf("\t/* %d */ total := total + (a * %d - b) / c + call step(b, %d);", i, i % 9973, i % 97)
+		print line
+		n += length(line) + 1
+		if (i % 16 == 0) { print "\tif odd total then a := a + 1 else b := b - 1;"; n += 47 }
+		if (i % 16 == 0 && width > 0) {
+			line = "\t\t/*"
+			while (length(line) < width) line = line "\n\t\t   the running total takes every statement below"
+			line = line " */"
+			print line
+			n += length(line) + 1
+		}
+	}
+	print "\twrite total"
+	print "end."
+}'
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Reports lexer throughput with each bulk scanner the CPU has, on a generated
+# program and on the same program with long block comments.
+# usage: lex.sh lexbench [megabytes]
+
+bench=$(realpath "$1")
+file=$(mktemp)
+
+for width in 0 400; do
+	"$(dirname "$0")/gen.sh" "${2:-16}" "$width" > "$file"
+	echo "comment width $width:"
+	for scanner in scalar sse2 avx2; do
+		"$bench" "$file" 5 "$scanner"
+	done
+done
+rm -f "$file"
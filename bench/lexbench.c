@@ -0,0 +1,53 @@
+/*
+	Times processText() alone on a source file and reports lexer
+	throughput with the bulk scanner the CPU picks, or the one named
+	(scalar, sse2 or avx2). Build with the lexer:
+
+		gcc -O2 -o lexbench bench/lexbench.c lexicalAnalyzer.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../lexicalAnalyzer.h"
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int i, repeat = (argc > 2) ? atoi(argv[2]) : 5;
+	double start, best = 0;
+
+	if(argc < 2)
+	{
+		printf("USAGE: ./lexbench [source file] [repeat] [scanner]\n");
+		return 0;
+	}
+
+	if(argc > 3 && !setScanner(argv[3]))
+	{
+		fprintf(stderr, "Error: Scanner %s is not available\n", argv[3]);
+		return 0;
+	}
+
+	openFiles(argv[1], "/dev/null");
+
+	// Best of repeat scans; the first also faults the mapping in
+	for(i = 0; i <= repeat; i++)
+	{
+		start = now();
+		processText();
+		if(i && (best == 0 || now() - start < best)) best = now() - start;
+	}
+
+	printf("%s: %zu bytes, %d tokens, %.4f s, %.1f MB/s\n", scannerName(), inputCharsSize, tokenCount, best,
+		inputCharsSize / best / (1 << 20));
+	return 1;
+}
@@ -0,0 +1,51 @@
+/*
+	Times scanning and parsing a source file, processText() and
+	parse_program(), and reports the best of several runs. Build with
+	the compiler:
+
+		gcc -O2 -o parsebench bench/parsebench.c parsegen.c symboltable.c lexicalAnalyzer.c module.c aot.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../lexicalAnalyzer.h"
+#include "../parsegen.h"
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int i, repeat = (argc > 2) ? atoi(argv[2]) : 5;
+	double start, lexed, best_lex = 0, best_parse = 0;
+
+	if(argc < 2)
+	{
+		printf("USAGE: ./parsebench [source file] [repeat]\n");
+		return 0;
+	}
+
+	openFiles(argv[1], "/dev/null");
+
+	// The first run also faults the mapping in
+	for(i = 0; i <= repeat; i++)
+	{
+		start = now();
+		processText();
+		lexed = now();
+		parse_program();
+
+		if(i && (best_lex == 0 || lexed - start < best_lex)) best_lex = lexed - start;
+		if(i && (best_parse == 0 || now() - lexed < best_parse)) best_parse = now() - lexed;
+	}
+
+	printf("%zu bytes, %d tokens, scan %.4f s, parse %.4f s\n", inputCharsSize, tokenCount, best_lex, best_parse);
+	return 1;
+}
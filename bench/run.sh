@@ -0,0 +1,47 @@
+#!/bin/bash
+# Runs every bench/*.txt program in no-trace mode and writes the results as JSON.
+# usage: run.sh driver engine repeat output.json
+
+driver=$(realpath "$1")
+engine=$2
+repeat=$3
+output=$(realpath -m "$4")
+dir=$(mktemp -d)
+first=1
+
+cd "$(dirname "$0")"
+
+{
+	printf '{\n  "engine": "%s",\n  "repeat": %d,\n  "benchmarks": [' "$engine" "$repeat"
+
+	for f in *.txt; do
+		name=${f%.txt}
+		cp "$f" "$dir/in.txt"
+
+		# Instruction counts are the same on every engine; the JIT does not count
+		steps=$(cd "$dir" && "$driver" -n -s -e switch < /dev/null 2>&1 >/dev/null | awk '/Instructions executed/ { print $3 }')
+		result=$(cd "$dir" && "$driver" -n -e "$engine" < /dev/null | tail -n 1)
+
+		# Best wall time of repeat runs, compile included
+		best=
+		for ((i = 0; i < repeat; i++)); do
+			start=$EPOCHREALTIME
+			(cd "$dir" && "$driver" -n -e "$engine" < /dev/null > /dev/null)
+			end=$EPOCHREALTIME
+			best=$(awk -v s="$start" -v e="$end" -v b="$best" 'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+		done
+
+		mips=$(awk -v n="${steps:-0}" -v t="$best" 'BEGIN { printf "%.1f", (t > 0) ? n / t / 1e6 : 0 }')
+
+		[ $first = 1 ] || printf ','
+		first=0
+		printf '\n    { "name": "%s", "instructions": %s, "seconds": %.6f, "mips": %s, "output": "%s" }' \
+			"$name" "${steps:-0}" "$best" "$mips" "$result"
+
+		echo "$name: ${steps:-0} instructions, ${best}s, $mips MIPS" >&2
+	done
+
+	printf '\n  ]\n}\n'
+} > "$output.tmp" && mv "$output.tmp" "$output"
+
+rm -rf "$dir"
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Compiles and runs generated programs of growing size to check that the
+# lexer and parser scale linearly: MB/s should stay flat as the source
+# doubles. Times include writing out.txt, which echoes the source.
+# usage: scale.sh driver [megabytes...]
+
+driver=$(realpath "$1")
+shift
+sizes=${*:-1 2 4 8 16}
+dir=$(mktemp -d)
+
+printf '%-8s%-12s%s\n' "MB" "Seconds" "MB/s"
+
+for mb in $sizes; do
+	"$(dirname "$0")/gen.sh" "$mb" > "$dir/in.txt"
+
+	start=$EPOCHREALTIME
+	(cd "$dir" && "$driver" -n < /dev/null > /dev/null)
+	end=$EPOCHREALTIME
+
+	awk -v mb="$mb" -v s="$start" -v e="$end" \
+		'BEGIN { printf "%-8d%-12.3f%.1f\n", mb, e - s, mb / (e - s) }'
+done
+
+rm -rf "$dir"
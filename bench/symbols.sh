@@ -0,0 +1,34 @@
+#!/bin/bash
+# Times scanning and parsing a generated program heavy in symbol lookups:
+# a thousand globals and procedures nested deep, each with its own locals,
+# whose statements name variables of every enclosing scope.
+# usage: symbols.sh parsebench [procedures] [depth]
+
+bench=$(realpath "$1")
+procs=${2:-1000}
+depth=${3:-12}
+dir=$(mktemp -d)
+
+awk -v procs="$procs" -v depth="$depth" '
+function name(d, i) { return (d < 0) ? sprintf("g%d", i) : sprintf("v%dx%d", d, i) }
+function ref(d) { d = int(rand() * (d + 2)) - 1; return name(d, int(rand() * ((d < 0) ? 1000 : 20))) }
+function proc(p, d,    i) {
+	printf "procedure p%dx%d(a);\n\tvar v%dx0", p, d, d
+	for (i = 1; i < 20; i++) printf ", v%dx%d", d, i
+	print ";"
+	if (d + 1 < depth) proc(p, d + 1)
+	print "begin"
+	for (i = 0; i < 20; i++) printf "\t%s := %s + %s * %s;\n", ref(d), ref(d), ref(d), ref(d)
+	printf "\treturn := %s\nend;\n", ref(d)
+}
+BEGIN {
+	srand(1)
+	printf "var g0"
+	for (i = 1; i < 1000; i++) printf ", g%d", i
+	print ";"
+	for (p = 0; p < procs; p++) proc(p, 0)
+	print "begin\n\tg0 := call p0x0(1)\nend."
+}' > "$dir/in.txt"
+
+"$bench" "$dir/in.txt"
+rm -rf "$dir"
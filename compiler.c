@@ -2,36 +2,212 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
 
 #include "vm.h"
 #include "parsegen.h"
 #include "lexicalAnalyzer.h"
+#include "trace.h"
+#include "module.h"
+#include "profile.h"
 
 #define PRINT_INPUT 1
 
-enum flags {L = 1, A = 2, V = 4};
+#define SNAPSHOT_FILE "vminput.snap"
+#define CHECKPOINT_SLICE (1 << 16)	// Instructions between checks for SIGUSR1
+
+enum flags {L = 1, A = 2, V = 4, N = 8, F = 16, S = 32, X = 64, P = 128};
+
+static volatile sig_atomic_t snapshot_requested;
+
+static void on_snapshot_signal(int sig)
+{
+	snapshot_requested = 1;
+}
+
+// Run in slices so snapshots are taken between instructions: on SIGUSR1 and every n instructions
+static void run_checkpointed(VM *vm, FILE *trace, const char *path, unsigned long long every)
+{
+	unsigned long long next = vm->steps + every;
+	int status;
+
+	signal(SIGUSR1, on_snapshot_signal);
+
+	while((status = vm_run_slice(vm, every ? next - vm->steps : CHECKPOINT_SLICE, trace)) != VM_HALTED)
+	{
+		// Nothing feeds input between slices, so a blocked READ is at the end of it
+		if(status == VM_BLOCKED) vm->input_eof = 1;
+
+		if(snapshot_requested || (every && vm->steps >= next))
+		{
+			snapshot_requested = 0;
+			if(!vm_save(vm, path))
+				fprintf(stderr, "Error: Could not write snapshot %s\n", path);
+			next = vm->steps + every;
+		}
+	}
+	signal(SIGUSR1, SIG_DFL);
+}
+
+// Record a binary trace of the last trace_cap steps to trace_file, if given, and count
+// instructions per opcode, line and procedure if profile is set; returns the trace
+static Trace *attach_recorders(VM *vm, const char *trace_file, unsigned trace_cap, int profile)
+{
+	Trace *trace = NULL;
+
+	if(trace_file)
+	{
+		if(!(trace = trace_create(trace_file, trace_cap)))
+			fprintf(stderr, "Error: Could not create trace file %s\n", trace_file);
+		vm->recorder = trace;
+	}
+
+	if(profile && !(vm->profile = profile_create(vm)))
+		fprintf(stderr, "Error: Could not create profile\n");
+	return trace;
+}
+
+static void report_profile(VM *vm)
+{
+	if(!vm->profile) return;
+
+	profile_report(vm->profile, stderr);
+	profile_free(vm->profile);
+	vm->profile = NULL;
+}
+
+static void print_stats(VM *vm)
+{
+	fprintf(stderr, "Instructions executed: %llu\n", vm->steps);
+
+	if(vm->verified)
+		fprintf(stderr, "Verified, deepest procedure frame: %d cells\n", vm->max_depth);
+
+	if(vm->fusion)
+		fprintf(stderr, "Dispatches eliminated by superinstructions: %llu (%.1f%%)\n", 
+			vm->fused_steps, 100.0 * vm->fused_steps / 
+			(vm->steps + vm->fused_steps + !vm->steps));
+}
 
 int main(int argc, char **argv)
 {
 	int i, c;
-	char flags = 0; 
+	int flags = 0;
 	FILE *code_file;
 	unsigned long file_pos;
-
- 	if (argc > 4) 
- 	{
- 		printf("Invalid number arguments for compiler!\n");
- 		return 0;
- 	}
+	char *trace_file = NULL;
+	unsigned trace_cap = TRACE_DEFAULT_CAPACITY;
+	unsigned long cap;
+	char *end;
+	int engine = DEFAULT_ENGINE;
+	unsigned stack_size = 0;
+	int cell_bits = 32;
+	int io = IO_INTERACTIVE;
+	FILE *in = stdin, *out = stdout;
+	char *out_name = NULL, *snapshot_file = NULL, *resume_file = NULL, *c_file = NULL;
+	unsigned long long checkpoint_every = 0;
+	Trace *trace = NULL;
+	VM *vm;
 
  	for(i = 1; i < argc; i++) 
  	{
  		if(strcmp(argv[i], "-l") == 0) flags |= L;
  		else if(strcmp(argv[i], "-a") == 0) flags |= A;
  		else if(strcmp(argv[i], "-v") == 0) flags |= V;
+ 		else if(strcmp(argv[i], "-t") == 0) engine = THREADED_ENGINE;
+ 		else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc) 
+ 		{
+ 			if((engine = engine_by_name(argv[++i])) < 0)
+ 			{
+ 				printf("Unknown engine: %s\n", argv[i]);
+ 				return 0;
+ 			}
+ 		}
+ 		else if(strcmp(argv[i], "-n") == 0) flags |= N;
+ 		else if(strcmp(argv[i], "-f") == 0) flags |= F;
+ 		else if(strcmp(argv[i], "-s") == 0) flags |= S;
+ 		else if(strcmp(argv[i], "-x") == 0) flags |= X;
+ 		else if(strcmp(argv[i], "-p") == 0) flags |= P;
+ 		else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) trace_file = argv[++i];
+ 		else if(strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+ 		{
+ 			// The ring is rounded up to a power of two, at most 2^31 records
+ 			cap = strtoul(argv[++i], &end, 10);
+ 			if(*end || end == argv[i] || cap < 1 || cap > (1ul << 31))
+ 			{
+ 				printf("Trace capacity must be from 1 to 2147483648: %s\n", argv[i]);
+ 				return 0;
+ 			}
+ 			trace_cap = cap;
+ 		}
+ 		else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc) stack_size = atoi(argv[++i]);
+ 		else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+ 		{
+ 			cell_bits = atoi(argv[++i]);
+ 			if(cell_bits != 16 && cell_bits != 32 && cell_bits != 64)
+ 			{
+ 				printf("Cell width must be 16, 32 or 64: %s\n", argv[i]);
+ 				return 0;
+ 			}
+ 		}
+ 		else if(strcmp(argv[i], "-b") == 0) io = IO_BUFFERED;
+ 		else if(strcmp(argv[i], "-B") == 0) io = IO_RAW;
+ 		else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+ 		{
+ 			if(!(in = fopen(argv[++i], "rb")))
+ 			{
+ 				printf("Could not open input file: %s\n", argv[i]);
+ 				return 0;
+ 			}
+ 		}
+ 		else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) out_name = argv[++i];
+ 		else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) snapshot_file = argv[++i];
+ 		else if(strcmp(argv[i], "-C") == 0 && i + 1 < argc) checkpoint_every = strtoull(argv[++i], NULL, 10);
+ 		else if(strcmp(argv[i], "-R") == 0 && i + 1 < argc) resume_file = argv[++i];
+ 		else if(strcmp(argv[i], "-g") == 0 && i + 1 < argc) c_file = argv[++i];
  		else printf("Invalid argument: %s\n", argv[i]);
  	}
 
+	// A resumed run appends to the output of the run it continues
+	if(out_name && !(out = fopen(out_name, resume_file ? "ab" : "wb")))
+	{
+		printf("Could not open output file: %s\n", out_name);
+		return 0;
+	}
+
+	if(checkpoint_every && !snapshot_file) snapshot_file = SNAPSHOT_FILE;
+
+	// Continue a run from its snapshot instead of compiling in.txt
+	if(resume_file)
+	{
+		if(!(vm = vm_create()))
+		{
+			fprintf(stderr, "Error: Could not create VM\n");
+			return 0;
+		}
+		vm->stack_size = stack_size;
+		vm->engine = engine;
+		vm->in = in;
+		vm->out = out;
+
+		if(!vm_resume(vm, resume_file)) return 0;
+
+		// There is no out.txt to trace to, but -r and -p work as on a fresh run
+		trace = attach_recorders(vm, trace_file, trace_cap, flags & P);
+
+		if(snapshot_file) run_checkpointed(vm, NULL, snapshot_file, checkpoint_every);
+		else vm_run(vm, NULL);
+
+		report_profile(vm);
+		if(flags & S) print_stats(vm);
+
+		vm_destroy(vm);
+		if(in != stdin) fclose(in);
+		if(out != stdout) fclose(out);
+		trace_close(trace);
+		return 1;
+	}
+
 	// Remove previous error file if it exists
 	remove("ef");
 
@@ -39,16 +215,41 @@ int main(int argc, char **argv)
 	openFiles("in.txt", "out.txt");
 	echoInput();
 	processText();
+	printLexemes(outFile);
 
 	// Print scanned lexemes to screen
 	if(flags & L) 
-		printf("%s\n\n%s\n\n", lexemeList, symbolicLexemeList);
+	{
+		printLexemeList(stdout);
+		printf("\n\n");
+		printSymbolicLexemeList(stdout);
+		printf("\n\n");
+	}
 
 	// Parse and generate assembly
 	parse_program();
 
-	code_file = fopen("vminput.txt", "w+");
-	print_assembly(code_file);
+	// Write a binary module, or the text format with -x
+	if(flags & X)
+	{
+		code_file = fopen("vminput.txt", "w+");
+		print_assembly(code_file);
+	}
+	else if(!(code_file = fopen(MODULE_FILE, "w+")) || !write_module(code_file, stack_size, cell_bits))
+	{
+		fprintf(stderr, "Error: Could not write %s\n", MODULE_FILE);
+		return 0;
+	}
+
+	// Translate to a C program as well
+	if(c_file)
+	{
+		FILE *c_out = fopen(c_file, "w");
+
+		if(!c_out || !write_c(c_out, stack_size))
+			fprintf(stderr, "Error: Could not write %s\n", c_file);
+		if(c_out) fclose(c_out);
+	}
 
 	printf("No errors, program is syntactically correct.\n\n");
 
@@ -61,17 +262,36 @@ int main(int argc, char **argv)
 	}
 
 	// Scan generated assembly into VM
-	rewind(code_file);
-	if(!read_input(code_file)) return 0;
+	if(!(vm = vm_create()))
+	{
+		fprintf(stderr, "Error: Could not create VM\n");
+		return 0;
+	}
+	vm->fusion = (flags & F) && !(flags & P);	// Profiles describe the code as compiled
+	vm->stack_size = stack_size;
+	vm->cell_bits = cell_bits;	// The module header sets it otherwise
+	vm->io = io;
+	vm->in = in;
+	vm->out = out;
+
+	if(flags & X)
+	{
+		rewind(code_file);
+		if(!vm_load(vm, code_file)) return 0;
+	}
+	else if(!vm_load_module(vm, MODULE_FILE)) return 0;
+
+	// Traces show 32-bit cells; other widths only run untraced
+	if(vm->cell_bits != 32) flags |= N;
 
 	// Print VM instructions
 	fprintf(outFile, "\n\n");
-	print_input(outFile);
+	vm_print_input(vm, outFile);
 	
 	if(flags & V)
 	{
 		printf("VM Instructions:\n");
-		print_input(stdout);
+		vm_print_input(vm, stdout);
 	}
 
 	// Remember position of VM output in outFile
@@ -79,8 +299,18 @@ int main(int argc, char **argv)
 	file_pos = ftell(outFile);
 	
 	// Execute compiled program
+	vm->engine = engine;
+
+	trace = attach_recorders(vm, trace_file, trace_cap, flags & P);
+
 	printf("Program execution:\n");
-	fetch_and_execute(outFile);
+	if(snapshot_file) run_checkpointed(vm, (flags & N) ? NULL : outFile, snapshot_file, checkpoint_every);
+	else vm_run(vm, (flags & N) ? NULL : outFile);
+
+	report_profile(vm);
+
+	// Print execution statistics
+	if(flags & S) print_stats(vm);
 	
 	// Print VM output
 	fclose(outFile);
@@ -92,6 +322,10 @@ int main(int argc, char **argv)
 		while((c = getc(outFile)) != EOF) putchar(c);
 
 	// Clean up
+	vm_destroy(vm);
+	if(in != stdin) fclose(in);
+	if(out != stdout) fclose(out);
+	trace_close(trace);
 	fclose(outFile);
 	fclose(code_file);
 
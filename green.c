@@ -0,0 +1,286 @@
+/*
+	Runs many compiled programs (modules or vminput.txt text) as green
+	threads: one VM instance per program, all multiplexed on this OS
+	thread. Each runnable instance gets a slice of at most -q instructions
+	per round; an instance at a READ with no input queued is parked until
+	poll() reports its input readable.
+
+	Output of prog goes to prog.out; SIO reads come from prog.in, which
+	may be a FIFO fed while the programs run, and hit end of input when
+	there is none. I/O is always batch mode: text by default, raw int32
+	with -B.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "module.h"
+
+#define DEFAULT_QUANTUM 10000
+#define READ_CHUNK 4096
+
+typedef struct Green {
+	VM *vm;
+	const char *path;
+	int in;				// Non-blocking input descriptor, -1 once at end
+	FILE *out;
+	char pending[16];	// Value split across reads
+	int pending_len;
+	int blocked;
+} Green;
+
+static int io = IO_BUFFERED;
+
+// Binary modules are mapped; anything else is read as text
+static int is_module(FILE *fp)
+{
+	char magic[4];
+	int n = fread(magic, 1, 4, fp);
+
+	rewind(fp);
+	return n == 4 && memcmp(magic, MODULE_MAGIC, 4) == 0;
+}
+
+// Load one program into g; returns 0 on failure
+static int start_program(Green *g, const char *path, int fusion, unsigned stack_size)
+{
+	char name[FILENAME_MAX];
+	FILE *code;
+	int ok;
+
+	memset(g, 0, sizeof(Green));
+	g->path = path;
+	g->in = -1;
+
+	if(!(code = fopen(path, "r")))
+	{
+		fprintf(stderr, "Error: Could not open %s\n", path);
+		return 0;
+	}
+
+	if(!(g->vm = vm_create()))
+	{
+		fclose(code);
+		return 0;
+	}
+
+	g->vm->fusion = fusion;
+	g->vm->io = io;
+	g->vm->stack_size = stack_size;
+
+	ok = is_module(code) ? vm_load_module(g->vm, path) : vm_load(g->vm, code);
+	fclose(code);
+
+	if(!ok)
+	{
+		fprintf(stderr, "Error: Could not load %s\n", path);
+		return 0;
+	}
+
+	// Slices run the 32-bit engines only
+	if(g->vm->cell_bits != 32)
+	{
+		fprintf(stderr, "Error: %s needs 32-bit cells to run as a green thread\n", path);
+		return 0;
+	}
+
+	// O_NONBLOCK also keeps open() of a FIFO from waiting for a writer
+	snprintf(name, sizeof(name), "%s.in", path);
+	if((g->in = open(name, O_RDONLY | O_NONBLOCK)) < 0)
+		g->vm->input_eof = 1;
+
+	snprintf(name, sizeof(name), "%s.out", path);
+	if(!(g->out = fopen(name, "wb")))
+	{
+		fprintf(stderr, "Error: Could not open I/O files for %s\n", path);
+		return 0;
+	}
+
+	g->vm->in = NULL;
+	g->vm->out = g->out;
+	return 1;
+}
+
+static void stop_program(Green *g)
+{
+	if(g->in >= 0) close(g->in);
+	if(g->out) fclose(g->out);
+	vm_destroy(g->vm);
+	g->vm = NULL;
+	g->in = -1;
+	g->out = NULL;
+}
+
+// Queue the value held in pending; text values end at whitespace
+static int push_pending(Green *g)
+{
+	int v;
+
+	if(!g->pending_len) return 1;
+
+	if(io == IO_RAW)
+		memcpy(&v, g->pending, sizeof(v));
+	else
+	{
+		g->pending[g->pending_len] = '\0';
+		v = strtol(g->pending, NULL, 10);
+	}
+
+	g->pending_len = 0;
+	return vm_push_input(g->vm, v);
+}
+
+// Read what input is available now; returns 0 on failure
+static int feed_input(Green *g)
+{
+	char buf[READ_CHUNK];
+	ssize_t n, i;
+
+	if((n = read(g->in, buf, sizeof(buf))) < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	// End of input: a trailing text value needs no separator
+	if(n == 0)
+	{
+		close(g->in);
+		g->in = -1;
+		g->vm->input_eof = 1;
+		return io == IO_RAW || push_pending(g);
+	}
+
+	for(i = 0; i < n; i++)
+	{
+		if(io == IO_RAW)
+		{
+			g->pending[g->pending_len++] = buf[i];
+			if(g->pending_len == sizeof(int) && !push_pending(g))
+				return 0;
+		}
+		else if((buf[i] >= '0' && buf[i] <= '9') || buf[i] == '-' || buf[i] == '+')
+		{
+			if(g->pending_len < sizeof(g->pending) - 1)
+				g->pending[g->pending_len++] = buf[i];
+		}
+		else if(!push_pending(g))
+			return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long quantum = DEFAULT_QUANTUM, steps = 0, slices = 0, waits = 0;
+	unsigned stack_size = 0;
+	int i, n, num_files, live = 0, runnable, num_fds, failed = 0, fusion = 0;
+	struct pollfd *fds;
+	Green *progs;
+	int *polled;
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i++)
+	{
+		if(strcmp(argv[i], "-q") == 0 && i + 1 < argc) quantum = strtoull(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc) stack_size = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-f") == 0) fusion = 1;
+		else if(strcmp(argv[i], "-B") == 0) io = IO_RAW;
+		else printf("Invalid argument: %s\n", argv[i]);
+	}
+
+	num_files = argc - i;
+
+	if(num_files < 1)
+	{
+		printf("USAGE: ./green [-q quantum] [-m cells] [-f] [-B] [program files]\n");
+		return 0;
+	}
+
+	if(quantum < 1) quantum = 1;
+
+	progs = calloc(num_files, sizeof(Green));
+	fds = malloc(num_files * sizeof(struct pollfd));
+	polled = malloc(num_files * sizeof(int));
+
+	if(!progs || !fds || !polled)
+	{
+		fprintf(stderr, "Error: Out of memory\n");
+		return 0;
+	}
+
+	for(n = 0; n < num_files; n++)
+	{
+		if(start_program(&progs[n], argv[i + n], fusion, stack_size)) live++;
+		else
+		{
+			stop_program(&progs[n]);
+			failed++;
+		}
+	}
+
+	while(live)
+	{
+		// Wait for input only when nothing can run
+		for(runnable = num_fds = n = 0; n < num_files; n++)
+		{
+			if(!progs[n].vm) continue;
+			if(!progs[n].blocked) runnable++;
+			else
+			{
+				fds[num_fds].fd = progs[n].in;
+				fds[num_fds].events = POLLIN;
+				polled[num_fds++] = n;
+			}
+		}
+
+		if(num_fds && poll(fds, num_fds, runnable ? 0 : -1) > 0)
+		{
+			for(n = 0; n < num_fds; n++)
+			{
+				Green *g = &progs[polled[n]];
+
+				if(!fds[n].revents) continue;
+				if(!feed_input(g))
+				{
+					fprintf(stderr, "Error: Could not read input for %s\n", g->path);
+					g->vm->input_eof = 1;
+				}
+				g->blocked = 0;
+			}
+		}
+
+		// One round: every runnable instance gets a slice
+		for(n = 0; n < num_files; n++)
+		{
+			Green *g = &progs[n];
+
+			if(!g->vm || g->blocked) continue;
+
+			switch(vm_run_slice(g->vm, quantum, NULL))
+			{
+				case VM_HALTED:
+					steps += g->vm->steps;
+					stop_program(g);
+					live--;
+					break;
+
+				case VM_BLOCKED:
+					g->blocked = 1;
+					waits++;
+					break;
+			}
+			slices++;
+		}
+	}
+
+	printf("%d programs, %d failed, %llu instructions executed in %llu slices, %llu input waits\n",
+		num_files, failed, steps, slices, waits);
+
+	free(progs);
+	free(fds);
+	free(polled);
+	return failed == 0;
+}
@@ -0,0 +1,335 @@
+/*
+	Baseline template JIT for x86-64 Linux. Each PM/0 instruction is
+	translated to a fixed sequence of machine code, with jumps patched to
+	native addresses. CAL, RET, RTN and SIO call back into the VM.
+
+	Register use in generated code:
+		rbx	&stack[0]
+		r12	sp
+		r13	bp
+		r14	native address of each code index (for RET and RTN)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vm.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+#define MAX_TEMPLATE 128	// Upper bound on bytes emitted per instruction
+
+struct Jit {
+	unsigned char *mem;
+	size_t size;
+	void **native;	// Native address of each code index, and of code_len
+	void (*entry)(void *target);
+};
+
+typedef struct Fixup {
+	unsigned char *at;	// rel32 to patch
+	int target;			// Code index it jumps to
+} Fixup;
+
+typedef struct Emitter {
+	unsigned char *p;
+	Fixup *fixups;
+	int num_fixups;
+	int code_len;
+	unsigned char *exit;	// Epilogue returning to the VM
+	const JitState *st;
+} Emitter;
+
+// Emit n bytes
+static void emit(Emitter *e, int n, ...)
+{
+	va_list ap;
+
+	va_start(ap, n);
+	while(n--) *e->p++ = (unsigned char) va_arg(ap, int);
+	va_end(ap);
+}
+
+static void emit32(Emitter *e, int32_t v)
+{
+	memcpy(e->p, &v, 4);
+	e->p += 4;
+}
+
+static void emit64(Emitter *e, const void *v)
+{
+	uint64_t u = (uint64_t) (uintptr_t) v;
+	memcpy(e->p, &u, 8);
+	e->p += 8;
+}
+
+// Emit a rel32 to the code index target, patched once all addresses are known
+static void emit_rel32(Emitter *e, int target)
+{
+	e->fixups[e->num_fixups].at = e->p;
+	e->fixups[e->num_fixups++].target = target;
+	emit32(e, 0);
+}
+
+// Emit a rel32 to the epilogue
+static void emit_exit32(Emitter *e)
+{
+	emit32(e, (int32_t) (e->exit - (e->p + 4)));
+}
+
+/* Register spills */
+static void store_regs(Emitter *e)
+{
+	emit(e, 2, 0x48, 0xB8); emit64(e, e->st->sp);	// mov rax, &sp
+	emit(e, 3, 0x44, 0x89, 0x20);					// mov [rax], r12d
+	emit(e, 2, 0x48, 0xB8); emit64(e, e->st->bp);	// mov rax, &bp
+	emit(e, 3, 0x44, 0x89, 0x28);					// mov [rax], r13d
+}
+
+static void load_regs(Emitter *e)
+{
+	emit(e, 2, 0x48, 0xBA); emit64(e, e->st->sp);	// mov rdx, &sp
+	emit(e, 3, 0x44, 0x8B, 0x22);					// mov r12d, [rdx]
+	emit(e, 2, 0x48, 0xBA); emit64(e, e->st->bp);	// mov rdx, &bp
+	emit(e, 3, 0x44, 0x8B, 0x2A);					// mov r13d, [rdx]
+}
+
+/* Stack access */
+static void load_tos_ecx(Emitter *e)  { emit(e, 4, 0x42, 0x8B, 0x0C, 0xA3); }	// mov ecx, [rbx+r12*4]
+static void load_tos_eax(Emitter *e)  { emit(e, 4, 0x42, 0x8B, 0x04, 0xA3); }	// mov eax, [rbx+r12*4]
+static void store_tos_ecx(Emitter *e) { emit(e, 4, 0x42, 0x89, 0x0C, 0xA3); }	// mov [rbx+r12*4], ecx
+static void store_tos_eax(Emitter *e) { emit(e, 4, 0x42, 0x89, 0x04, 0xA3); }	// mov [rbx+r12*4], eax
+static void inc_sp(Emitter *e) { emit(e, 3, 0x41, 0xFF, 0xC4); }				// inc r12d
+static void dec_sp(Emitter *e) { emit(e, 3, 0x41, 0xFF, 0xCC); }				// dec r12d
+
+// rax = base(lex, bp) + m, walking the static links; sign-extended, as a
+// parameter's negative offset may point below the stack into its guard
+static void frame_addr(Emitter *e, int lex, int m)
+{
+	emit(e, 3, 0x44, 0x89, 0xE8);				// mov eax, r13d
+	while(lex-- > 0)
+		emit(e, 4, 0x8B, 0x44, 0x83, 0x04);		// mov eax, [rbx+rax*4+4]
+	if(m) { emit(e, 1, 0x05); emit32(e, m); }	// add eax, m
+	if(m < 0) emit(e, 3, 0x48, 0x63, 0xC0);		// movsxd rax, eax
+}
+
+// Call back into the VM for a CAL, RET or SIO; eax holds the next pc
+static void call_vm(Emitter *e, int op, int l, int m, int next)
+{
+	store_regs(e);
+	emit(e, 2, 0x48, 0xBF); emit64(e, e->st->ctx);	// mov rdi, ctx
+	emit(e, 1, 0xBE); emit32(e, op);				// mov esi, op
+	emit(e, 1, 0xBA); emit32(e, l);					// mov edx, l
+	emit(e, 1, 0xB9); emit32(e, m);					// mov ecx, m
+	emit(e, 2, 0x41, 0xB8); emit32(e, next);		// mov r8d, next
+	emit(e, 2, 0x48, 0xB8); emit64(e, (void *) e->st->exec);	// mov rax, exec
+	emit(e, 2, 0xFF, 0xD0);							// call rax
+	emit(e, 2, 0x89, 0xC0);							// mov eax, eax
+	load_regs(e);
+}
+
+// Return through the VM; leave on a halt or a return past the code, else jump via the table
+static void return_op(Emitter *e, const inst *i, int line)
+{
+	call_vm(e, i->op, i->l, i->m, line + 1);
+	emit(e, 1, 0x3D); emit32(e, e->code_len);		// cmp eax, code_len
+	emit(e, 2, 0x0F, 0x83); emit_exit32(e);			// jae exit
+	emit(e, 4, 0x41, 0xFF, 0x24, 0xC6);				// jmp [r14+rax*8]
+}
+
+static void binary_op(Emitter *e, int m)
+{
+	// setcc opcode for EQL, NEQ, LSS, LEQ, GTR, GEQ
+	static const unsigned char setcc[] = { 0x94, 0x95, 0x9C, 0x9E, 0x9F, 0x9D };
+
+	load_tos_ecx(e);
+	dec_sp(e);
+	load_tos_eax(e);
+
+	switch(m)
+	{
+		case 2: emit(e, 2, 0x01, 0xC8); break;						// add eax, ecx
+		case 3: emit(e, 2, 0x29, 0xC8); break;						// sub eax, ecx
+		case 4: emit(e, 3, 0x0F, 0xAF, 0xC1); break;				// imul eax, ecx
+		case 5: emit(e, 3, 0x99, 0xF7, 0xF9); break;				// cdq; idiv ecx
+		case 7: emit(e, 5, 0x99, 0xF7, 0xF9, 0x89, 0xD0); break;	// cdq; idiv ecx; mov eax, edx
+		default:
+			emit(e, 2, 0x39, 0xC8);									// cmp eax, ecx
+			emit(e, 3, 0x0F, setcc[m - 8], 0xC0);					// setcc al
+			emit(e, 3, 0x0F, 0xB6, 0xC0);							// movzx eax, al
+	}
+	store_tos_eax(e);
+}
+
+// Translate one instruction; returns 0 if it has no template
+static int translate(Emitter *e, const inst *i, int line)
+{
+	switch(i->op)
+	{
+		case 1: // LIT
+			inc_sp(e);
+			emit(e, 4, 0x42, 0xC7, 0x04, 0xA3); emit32(e, i->m);	// mov [rbx+r12*4], m
+			break;
+		case 2: // OPR
+			if(i->m == 0) return_op(e, i, line);
+			else if(i->m == 1) emit(e, 4, 0x42, 0xF7, 0x1C, 0xA3);	// neg [rbx+r12*4]
+			else if(i->m == 6)
+			{
+				load_tos_eax(e);
+				emit(e, 1, 0x99);									// cdq
+				emit(e, 1, 0xB9); emit32(e, 2);						// mov ecx, 2
+				emit(e, 2, 0xF7, 0xF9);								// idiv ecx
+				emit(e, 4, 0x42, 0x89, 0x14, 0xA3);					// mov [rbx+r12*4], edx
+			}
+			else binary_op(e, i->m);
+			break;
+		case 3: // LOD
+			frame_addr(e, i->l, i->m);
+			emit(e, 3, 0x8B, 0x0C, 0x83);		// mov ecx, [rbx+rax*4]
+			inc_sp(e);
+			store_tos_ecx(e);
+			break;
+		case 4: // STO
+			frame_addr(e, i->l, i->m);
+			load_tos_ecx(e);
+			dec_sp(e);
+			emit(e, 3, 0x89, 0x0C, 0x83);		// mov [rbx+rax*4], ecx
+			break;
+		case 5: // CAL
+			call_vm(e, i->op, i->l, i->m, line + 1);
+			emit(e, 1, 0xE9); emit_rel32(e, i->m);	// jmp target
+			break;
+		case 6: // INC
+			emit(e, 3, 0x41, 0x81, 0xC4); emit32(e, i->m);	// add r12d, m
+			break;
+		case 7: // JMP
+			emit(e, 1, 0xE9); emit_rel32(e, i->m);
+			break;
+		case 8: // JPC
+			load_tos_ecx(e);
+			dec_sp(e);
+			emit(e, 2, 0x85, 0xC9);						// test ecx, ecx
+			emit(e, 2, 0x0F, 0x84); emit_rel32(e, i->m);	// jz target
+			break;
+		case 9: // SIO
+			if(i->m < 1 || i->m > 3) break;
+			call_vm(e, i->op, i->l, i->m, line + 1);
+			if(i->m == 3) 
+			{
+				emit(e, 1, 0xE9); emit_exit32(e);		// jmp exit
+			}
+			break;
+		case RTN:
+			return_op(e, i, line);
+			break;
+		default:
+			return 0;
+	}
+	return 1;
+}
+
+Jit *jit_compile(const inst *code, int code_len, const JitState *st)
+{
+	Emitter e = { 0 };
+	Jit *j;
+	int i, t;
+
+	if( !(j = calloc(1, sizeof(Jit))) )
+		return NULL;
+
+	j->size = (size_t) (code_len + 2) * MAX_TEMPLATE;
+	j->native = calloc(code_len + 1, sizeof(void *));
+	e.fixups = calloc(code_len + 1, sizeof(Fixup));
+	e.code_len = code_len;
+	e.st = st;
+
+	j->mem = mmap(NULL, j->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(j->mem == MAP_FAILED || !j->native || !e.fixups)
+	{
+		if(j->mem == MAP_FAILED) j->mem = NULL;
+		free(e.fixups);
+		jit_free(j);
+		return NULL;
+	}
+
+	e.p = j->mem;
+
+	// Entry: save callee-saved registers, load VM registers, jump to rdi
+	j->entry = (void (*)(void *)) e.p;
+	emit(&e, 1, 0x53);							// push rbx
+	emit(&e, 8, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);	// push r12-r15
+	emit(&e, 2, 0x48, 0xBB); emit64(&e, st->stack);	// mov rbx, stack
+	emit(&e, 2, 0x48, 0xB8); emit64(&e, st->sp);		// mov rax, &sp
+	emit(&e, 3, 0x44, 0x8B, 0x20);					// mov r12d, [rax]
+	emit(&e, 2, 0x48, 0xB8); emit64(&e, st->bp);		// mov rax, &bp
+	emit(&e, 3, 0x44, 0x8B, 0x28);					// mov r13d, [rax]
+	emit(&e, 2, 0x49, 0xBE); emit64(&e, j->native);	// mov r14, native
+	emit(&e, 2, 0xFF, 0xE7);							// jmp rdi
+
+	// Exit: store VM registers and return
+	e.exit = e.p;
+	store_regs(&e);
+	emit(&e, 8, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C);	// pop r15-r12
+	emit(&e, 2, 0x5B, 0xC3);						// pop rbx; ret
+
+	for(i = 0; i < code_len; i++)
+	{
+		j->native[i] = e.p;
+
+		if(!translate(&e, &code[i], i))
+		{
+			free(e.fixups);
+			jit_free(j);
+			return NULL;
+		}
+	}
+
+	// Running off the end of the code
+	j->native[code_len] = e.p;
+	emit(&e, 2, 0x48, 0xB8); emit64(&e, st->pc);		// mov rax, &pc
+	emit(&e, 2, 0xC7, 0x00); emit32(&e, code_len);	// mov [rax], code_len
+	emit(&e, 1, 0xE9); emit_exit32(&e);
+
+	// Patch jumps; targets outside the code stop the program like the interpreter
+	for(i = 0; i < e.num_fixups; i++)
+	{
+		t = e.fixups[i].target;
+		if(t < 0 || t > code_len) t = code_len;
+		*(int32_t *) e.fixups[i].at = (int32_t) ((unsigned char *) j->native[t] - (e.fixups[i].at + 4));
+	}
+	free(e.fixups);
+
+	if(mprotect(j->mem, j->size, PROT_READ | PROT_EXEC) < 0)
+	{
+		jit_free(j);
+		return NULL;
+	}
+	return j;
+}
+
+void jit_run(Jit *j, unsigned start)
+{
+	j->entry(j->native[start]);
+}
+
+void jit_free(Jit *j)
+{
+	if(!j) return;
+	if(j->mem) munmap(j->mem, j->size);
+	free(j->native);
+	free(j);
+}
+
+#else
+
+Jit *jit_compile(const inst *code, int code_len, const JitState *st) { return NULL; }
+void jit_run(Jit *j, unsigned start) {}
+void jit_free(Jit *j) {}
+
+#endif
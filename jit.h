@@ -0,0 +1,22 @@
+#ifndef JIT_H
+#define JIT_H
+
+/* Machine state the generated code works on; the registers live in the VM */
+typedef struct JitState {
+	void *ctx;	// Passed back to exec
+	int *stack;
+	unsigned *sp;
+	unsigned *bp;
+	unsigned *pc;
+
+	// Executes a CAL, RET or SIO and returns the next pc, or -1 once halted
+	int (*exec)(void *ctx, int op, int l, int m, int next);
+} JitState;
+
+typedef struct Jit Jit;
+
+Jit *jit_compile(const inst *code, int code_len, const JitState *st);
+void jit_run(Jit *j, unsigned start);
+void jit_free(Jit *j);
+
+#endif
@@ -1,25 +1,32 @@
 /*
 	Lexical Analyzer
+
+	A table-driven DFA: every source byte is classified by charClass[]
+	and moves the scanner through transitions[][]. Lexemes end in a final
+	state, which adds the token, and reserved words are found with one
+	perfect-hash probe. Runs of whitespace, comment bodies, identifiers
+	and numbers are skipped 16 or 32 bytes at a time where the CPU has
+	SSE2 or AVX2. Identifiers are interned as they are scanned, so each
+	identifier token carries a dense id the parser looks symbols up by.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #include "lexicalAnalyzer.h"
 
 //~~~Internal Representation Stuff~~~
 
-//Internal representation stuff
-int nulsym = 1, identsym = 2, numbersym = 3, plussym = 4,
-minussym = 5, multsym = 6, slashsym = 7, oddsym = 8, eqlsym = 9,
-neqsym = 10, lessym = 11, leqsym = 12, gtrsym = 13, geqsym = 14,
-lparentsym = 15, rparentsym = 16, commasym = 17, semicolonsym = 18,
-periodsym = 19, becomesym = 20, beginsym = 21, endsym = 22, ifsym = 23,
-thensym = 24, whilesym = 25, dosym = 26, callsym = 27, constsym = 28,
-varsym = 29, procsym = 30/*new*/, writesym = 31, 
-readsym = 32, elsesym = 33/*new*/;
-
 //Internal representation mapping, from integer to string.
 char IRMapping[34][64] = {
 "ZERO",
@@ -59,164 +66,361 @@ char IRMapping[34][64] = {
 
 };
 
-//List of symbols allowed
-char symbols[] = {'+', '-', '*', '/', '(', ')', '=', ',', '.', '<', '>', ';', ':'};
-char reserved[14][32] = {
-"const",
-"var",
-"procedure", // new
-"call",
-"begin",
-"end",
-"if",
-"then",
-"else", // new
-"while",
-"do",
-"read",
-"write",
-"odd"
+//Reserved words, at the slot KEYWORD_HASH gives for their first two letters and length.
+//No two collide; gcc -Wextra reports a collision as an overridden initializer.
+#define KEYWORD_HASH(first, second, length) ((((first) << 3) ^ (second) ^ ((length) << 2)) & 31)
+
+typedef struct Keyword {
+	const char * name;
+	int length;
+	int kind;
+} Keyword;
+
+const Keyword keywords[32] = {
+	[KEYWORD_HASH('c', 'o', 5)] = {"const", 5, constsym},
+	[KEYWORD_HASH('v', 'a', 3)] = {"var", 3, varsym},
+	[KEYWORD_HASH('p', 'r', 9)] = {"procedure", 9, procsym},
+	[KEYWORD_HASH('c', 'a', 4)] = {"call", 4, callsym},
+	[KEYWORD_HASH('b', 'e', 5)] = {"begin", 5, beginsym},
+	[KEYWORD_HASH('e', 'n', 3)] = {"end", 3, endsym},
+	[KEYWORD_HASH('i', 'f', 2)] = {"if", 2, ifsym},
+	[KEYWORD_HASH('t', 'h', 4)] = {"then", 4, thensym},
+	[KEYWORD_HASH('e', 'l', 4)] = {"else", 4, elsesym},
+	[KEYWORD_HASH('w', 'h', 5)] = {"while", 5, whilesym},
+	[KEYWORD_HASH('d', 'o', 2)] = {"do", 2, dosym},
+	[KEYWORD_HASH('r', 'e', 4)] = {"read", 4, readsym},
+	[KEYWORD_HASH('w', 'r', 5)] = {"write", 5, writesym},
+	[KEYWORD_HASH('o', 'd', 3)] = {"odd", 3, oddsym}
 };
 
-//Returns the index in reserved of the string pointed to by [identifier].
-int reservedIndex(char * identifier)
+//Returns the token type of the identifier or reserved word of [length] characters at [word].
+int keywordKind(const char * word, int length)
 {
-	for(int i = 0; i < 14; i++)
+	const Keyword * k;
+
+	if (length < 2)
+		return identsym;
+
+	k = &keywords[KEYWORD_HASH(word[0], word[1], length)];
+	if (k->length == length && memcmp(k->name, word, length) == 0)
+		return k->kind;
+	return identsym;
+}
+
+//~~~Scanner tables~~~
+
+//Character classes
+enum {
+	C_INVALID, C_SPACE, C_LETTER, C_DIGIT, C_SYMBOL, C_SLASH, C_STAR,
+	C_LESS, C_GREATER, C_COLON, C_EQUAL, C_NUL, C_EOF, NUM_CLASSES
+};
+
+//Classes of the source bytes; anything not listed is invalid
+const unsigned char charClass[256] = {
+	['\t'] = C_SPACE, ['\n'] = C_SPACE, ['\r'] = C_SPACE, [' '] = C_SPACE,
+	['a' ... 'z'] = C_LETTER, ['A' ... 'Z'] = C_LETTER,
+	['0' ... '9'] = C_DIGIT,
+	['+'] = C_SYMBOL, ['-'] = C_SYMBOL, ['('] = C_SYMBOL, [')'] = C_SYMBOL,
+	[','] = C_SYMBOL, ['.'] = C_SYMBOL, [';'] = C_SYMBOL,
+	['/'] = C_SLASH, ['*'] = C_STAR, ['<'] = C_LESS, ['>'] = C_GREATER,
+	[':'] = C_COLON, ['='] = C_EQUAL, ['\0'] = C_NUL
+};
+
+//Token types of the one-character symbols
+const unsigned char symbolKind[256] = {
+	['+'] = plussym, ['-'] = minussym, ['*'] = multsym, ['('] = lparentsym,
+	[')'] = rparentsym, ['='] = eqlsym, [','] = commasym, ['.'] = periodsym,
+	[';'] = semicolonsym
+};
+
+//Scanner states; from F_SYMBOL on, the lexeme is complete or in error
+enum {
+	S_START, S_IDENT, S_NUMBER, S_LESS, S_GREATER, S_COLON, S_SLASH, S_COMMENT, S_STAR,
+	F_SYMBOL, F_IDENT, F_NUMBER, F_LSS, F_LEQ, F_NEQ, F_GTR, F_GEQ, F_BECOMES, F_SLASH, F_END,
+	E_CHAR, E_NUMBER_LETTER, E_SYMBOL, E_COMMENT
+};
+
+//The next state for each state and character class. The character is consumed
+//when scanning goes on; final states consume it only if it is part of the lexeme.
+const unsigned char transitions[S_STAR + 1][NUM_CLASSES] = {
+	[S_START] = {
+		E_CHAR, S_START, S_IDENT, S_NUMBER, F_SYMBOL, S_SLASH, F_SYMBOL,
+		S_LESS, S_GREATER, S_COLON, F_SYMBOL, F_END, F_END
+	},
+	[S_IDENT] = {
+		E_CHAR, F_IDENT, S_IDENT, S_IDENT, F_IDENT, F_IDENT, F_IDENT,
+		F_IDENT, F_IDENT, F_IDENT, F_IDENT, F_IDENT, F_IDENT
+	},
+	[S_NUMBER] = {
+		E_CHAR, F_NUMBER, E_NUMBER_LETTER, S_NUMBER, F_NUMBER, F_NUMBER, F_NUMBER,
+		F_NUMBER, F_NUMBER, F_NUMBER, F_NUMBER, F_NUMBER, F_NUMBER
+	},
+	[S_LESS] = {
+		E_CHAR, F_LSS, F_LSS, F_LSS, F_LSS, F_LSS, F_LSS,
+		F_LSS, F_NEQ, F_LSS, F_LEQ, F_LSS, F_LSS
+	},
+	[S_GREATER] = {
+		E_CHAR, F_GTR, F_GTR, F_GTR, F_GTR, F_GTR, F_GTR,
+		F_GTR, F_GTR, F_GTR, F_GEQ, F_GTR, F_GTR
+	},
+	[S_COLON] = {
+		E_CHAR, E_SYMBOL, E_SYMBOL, E_SYMBOL, E_SYMBOL, E_SYMBOL, E_SYMBOL,
+		E_SYMBOL, E_SYMBOL, E_SYMBOL, F_BECOMES, E_SYMBOL, E_SYMBOL
+	},
+	[S_SLASH] = {
+		E_CHAR, F_SLASH, F_SLASH, F_SLASH, F_SLASH, F_SLASH, S_COMMENT,
+		F_SLASH, F_SLASH, F_SLASH, F_SLASH, F_SLASH, F_SLASH
+	},
+	//Comment bodies may hold any byte
+	[S_COMMENT] = {
+		S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, S_STAR,
+		S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, E_COMMENT
+	},
+	[S_STAR] = {
+		S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, S_START, S_STAR,
+		S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, S_COMMENT, E_COMMENT
+	}
+};
+
+//~~~Bulk scanning~~~
+
+//Each skipper returns the index of the first byte from [i] on that ends its run, at most [n].
+//Those that cross newlines add them to [lines]. A comment body ends at the '*' of its "*/".
+typedef struct Scanner {
+	const char * name;
+	size_t (*space)(const unsigned char * s, size_t i, size_t n, int * lines);
+	size_t (*word)(const unsigned char * s, size_t i, size_t n);
+	size_t (*digits)(const unsigned char * s, size_t i, size_t n);
+	size_t (*comment)(const unsigned char * s, size_t i, size_t n, int * lines);
+} Scanner;
+
+size_t spaceScalar(const unsigned char * s, size_t i, size_t n, int * lines)
+{
+	for(; i < n && charClass[s[i]] == C_SPACE; i++)
 	{
-		if (strcmp(reserved[i], identifier) == 0)
-		{
-			return i;
-		}
+		*lines += s[i] == '\n';
 	}
-	return -1;
+	return i;
+}
+
+size_t wordScalar(const unsigned char * s, size_t i, size_t n)
+{
+	while(i < n && (charClass[s[i]] == C_LETTER || charClass[s[i]] == C_DIGIT))
+		i++;
+	return i;
 }
 
-//Maps an index in reserved to the proper internal representation...
-int mapReserved(int spotInReserved)
+size_t digitsScalar(const unsigned char * s, size_t i, size_t n)
 {
-	if (spotInReserved == 0)
-		return constsym;
-	if (spotInReserved == 1)
-		return varsym;
-	if (spotInReserved == 2)
-		return procsym;
-	if (spotInReserved == 3)
-		return callsym;
-	if (spotInReserved == 4)
-		return beginsym;
-	if (spotInReserved == 5)
-		return endsym;
-	if (spotInReserved == 6)
-		return ifsym;
-	if (spotInReserved == 7)
-		return thensym;
-	if (spotInReserved == 8)
-	 	return elsesym;
-	if (spotInReserved == 9)
-		return whilesym;
-	if (spotInReserved == 10)
-		return dosym;
-	if (spotInReserved == 11)
-		return readsym;
-	if (spotInReserved == 12)
-		return writesym;
-	if (spotInReserved == 13)
-		return oddsym;
-    return -1;
+	while(i < n && charClass[s[i]] == C_DIGIT)
+		i++;
+	return i;
 }
 
-//Maps a symbol from character to internal representation...
-int mapSymbol(char * symbol)
+size_t commentScalar(const unsigned char * s, size_t i, size_t n, int * lines)
 {
-	if (strcmp(symbol, "+") == 0)
-		return plussym;
-	if (strcmp(symbol, "-") == 0)
-		return minussym;
-	if (strcmp(symbol, "*") == 0)
-		return multsym;
-	if (strcmp(symbol, "/") == 0)
-		return slashsym;
-	if (strcmp(symbol, "(") == 0)
-		return lparentsym;
-	if (strcmp(symbol, ")") == 0)
-		return rparentsym;
-	if (strcmp(symbol, "=") == 0)
-		return eqlsym;
-	if (strcmp(symbol, ",") == 0)
-		return commasym;
-	if (strcmp(symbol, ".") == 0)
-		return periodsym;
-	if (strcmp(symbol, "<") == 0)
-		return lessym;
-	if (strcmp(symbol, ">") == 0)
-		return gtrsym;
-	if (strcmp(symbol, ";") == 0)
-		return semicolonsym;
-		
-	if (strcmp(symbol, "<>") == 0)
-		return neqsym;
-	if (strcmp(symbol, "<=") == 0)
-		return leqsym;
-	if (strcmp(symbol, ">=") == 0)
-		return geqsym;
-	if (strcmp(symbol, ":=") == 0)
-		return becomesym;
-    return -1;
+	for(; i + 1 < n && !(s[i] == '*' && s[i + 1] == '/'); i++)
+	{
+		*lines += s[i] == '\n';
+	}
+	return i;
 }
 
-//~~~Character Manipulation Methods~~~
+const Scanner scalarScanner = {"scalar", spaceScalar, wordScalar, digitsScalar, commentScalar};
+
+#ifdef HAVE_X86_SIMD
+
+//Bytes of [v] in [low, low + count), compared unsigned by biasing into signed range
+#define IN_RANGE16(v, low, count) _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8(128 - (low))), _mm_set1_epi8(-128 + (count)))
+#define IN_RANGE32(v, low, count) _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + (count)), _mm256_add_epi8(v, _mm256_set1_epi8(128 - (low))))
 
-//Returns 1 iff [theChar] is a uppercase letter, 0 otherwise.
-int isUpper(char theChar)
+//Masks of the bytes that are whitespace, alphanumeric, digits or newlines; "*/" starts
+#define SPACE16(v) _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), \
+	_mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))), _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')))))
+#define WORD16(v) _mm_movemask_epi8(_mm_or_si128(IN_RANGE16(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 26), IN_RANGE16(v, '0', 10)))
+#define DIGITS16(v) _mm_movemask_epi8(IN_RANGE16(v, '0', 10))
+#define NEWLINES16(v) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))
+
+#define SPACE32(v) (unsigned) _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), \
+	_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))), _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')))))
+#define WORD32(v) (unsigned) _mm256_movemask_epi8(_mm256_or_si256(IN_RANGE32(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 26), IN_RANGE32(v, '0', 10)))
+#define DIGITS32(v) (unsigned) _mm256_movemask_epi8(IN_RANGE32(v, '0', 10))
+#define NEWLINES32(v) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))
+
+//Newlines of [newlines] before the lowest set bit of [stop]
+#define LINES_BEFORE(newlines, stop) __builtin_popcount((newlines) & (((stop) & -(stop)) - 1))
+
+__attribute__((target("sse2")))
+size_t spaceSse2(const unsigned char * s, size_t i, size_t n, int * lines)
 {
-	return theChar >= 65 && theChar <= 90;
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		unsigned run = SPACE16(v), newlines = NEWLINES16(v);
+
+		if (run != 0xFFFF)
+		{
+			*lines += LINES_BEFORE(newlines, ~run);
+			return i + __builtin_ctz(~run);
+		}
+		*lines += __builtin_popcount(newlines);
+	}
+	return spaceScalar(s, i, n, lines);
 }
 
-//Returns 1 iff [theChar] is a lowercase letter, 0 otherwise.
-int isLower(char theChar)
+__attribute__((target("sse2")))
+size_t wordSse2(const unsigned char * s, size_t i, size_t n)
 {
-	return theChar >= 97 && theChar <= 122;
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		unsigned run = WORD16(v);
+
+		if (run != 0xFFFF)
+			return i + __builtin_ctz(~run);
+	}
+	return wordScalar(s, i, n);
+}
+
+__attribute__((target("sse2")))
+size_t digitsSse2(const unsigned char * s, size_t i, size_t n)
+{
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		unsigned run = DIGITS16(v);
+
+		if (run != 0xFFFF)
+			return i + __builtin_ctz(~run);
+	}
+	return digitsScalar(s, i, n);
+}
+
+//A "*/" starts where a '*' lines up with a '/' in the block one byte on
+__attribute__((target("sse2")))
+size_t commentSse2(const unsigned char * s, size_t i, size_t n, int * lines)
+{
+	for(; i + 17 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i after = _mm_loadu_si128((const __m128i *) (s + i + 1));
+		unsigned end = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')), _mm_cmpeq_epi8(after, _mm_set1_epi8('/'))));
+		unsigned newlines = NEWLINES16(v);
+
+		if (end)
+		{
+			*lines += LINES_BEFORE(newlines, end);
+			return i + __builtin_ctz(end);
+		}
+		*lines += __builtin_popcount(newlines);
+	}
+	return commentScalar(s, i, n, lines);
 }
 
-//Returns 1 iff [theChar] is an alphabetic letter, 0 otherwise.
-int isAlpha(char theChar)
+__attribute__((target("avx2")))
+size_t spaceAvx2(const unsigned char * s, size_t i, size_t n, int * lines)
 {
-	return isLower(theChar) || isUpper(theChar);
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		unsigned run = SPACE32(v), newlines = NEWLINES32(v);
+
+		if (run != 0xFFFFFFFF)
+		{
+			*lines += LINES_BEFORE(newlines, ~run);
+			return i + __builtin_ctz(~run);
+		}
+		*lines += __builtin_popcount(newlines);
+	}
+	return spaceSse2(s, i, n, lines);
 }
 
-//Returns 1 iff [theChar] is a digit 0-9, 0 otherwise.
-int isDigit(char theChar)
+__attribute__((target("avx2")))
+size_t wordAvx2(const unsigned char * s, size_t i, size_t n)
 {
-	return theChar >= 48 && theChar <= 57;
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		unsigned run = WORD32(v);
+
+		if (run != 0xFFFFFFFF)
+			return i + __builtin_ctz(~run);
+	}
+	return wordSse2(s, i, n);
 }
 
-//Returns 1 iff [theChar] is either a digit or an alphabetic letter, 0 otherwise.
-int isAlphanumeric(char theChar)
+__attribute__((target("avx2")))
+size_t digitsAvx2(const unsigned char * s, size_t i, size_t n)
 {
-	return isAlpha(theChar) || isDigit(theChar);
+	for(; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		unsigned run = DIGITS32(v);
+
+		if (run != 0xFFFFFFFF)
+			return i + __builtin_ctz(~run);
+	}
+	return digitsSse2(s, i, n);
 }
 
-//Returns 1 iff [theChar] is a valid whitespace or invisible character, 0 otherwise.
-int isInvisible(char theChar)
+__attribute__((target("avx2")))
+size_t commentAvx2(const unsigned char * s, size_t i, size_t n, int * lines)
 {
-	return theChar == 9 || theChar == 10 || theChar == 13 || theChar == 32;
+	for(; i + 33 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i after = _mm256_loadu_si256((const __m256i *) (s + i + 1));
+		unsigned end = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')), _mm256_cmpeq_epi8(after, _mm256_set1_epi8('/'))));
+		unsigned newlines = NEWLINES32(v);
+
+		if (end)
+		{
+			*lines += LINES_BEFORE(newlines, end);
+			return i + __builtin_ctz(end);
+		}
+		*lines += __builtin_popcount(newlines);
+	}
+	return commentSse2(s, i, n, lines);
 }
 
-//Returns 1 iff [theChar] is a valid symbol, 0 otherwise.
-int isSymbol(char theChar)
+const Scanner sse2Scanner = {"sse2", spaceSse2, wordSse2, digitsSse2, commentSse2};
+const Scanner avx2Scanner = {"avx2", spaceAvx2, wordAvx2, digitsAvx2, commentAvx2};
+
+#endif
+
+//Bulk scanner processText() uses, the best the CPU runs unless set
+const Scanner * scanner;
+
+//Use the scanner called [name]; returns 0 if it is unknown or the CPU lacks it.
+int setScanner(const char * name)
 {
-	for(int i = 0; i < 13; i++)
+	if (strcmp(name, "scalar") == 0)
+	{
+		scanner = &scalarScanner;
+		return 1;
+	}
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+	{
+		scanner = &sse2Scanner;
+		return 1;
+	}
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
 	{
-		if (symbols[i] == theChar)
-			return 1;
+		scanner = &avx2Scanner;
+		return 1;
 	}
+#endif
 	return 0;
 }
 
-//Returns 1 iff [theChar] is a valid character used for scanning, 0 otherwise.
-int isValid(char theChar)
+//Name of the bulk scanner in use, choosing it first if need be.
+const char * scannerName()
 {
-	return isAlphanumeric(theChar) || isSymbol(theChar) || isInvisible(theChar) || theChar == '\0';
+	if (scanner == NULL && !setScanner("avx2") && !setScanner("sse2"))
+		setScanner("scalar");
+	return scanner->name;
 }
 
 //~~~Error state stuff~~~
@@ -234,337 +438,333 @@ void throwError(char * message)
 
 //~~~File handling stuff~~~
 
-//Our input file
-int ip = 0;
-char inputChars[MAX_CODE_LENGTH];
-int inputCharsSize;
+//Our input file, mapped read-only
+size_t ip = 0;
+const char * inputChars;
+size_t inputCharsSize;
+
+//Source line of the next input character
+int lineNumber = 1;
 
 //The output file
 FILE * outFile;
 
-//Gets a character from the input; enforces that the character is valid iff ignoreValidity is 0.
-char getChar(int ignoreValidity)
-{	
-	//Make sure this char is even actually existing...
-	if (ip > inputCharsSize)
+//This method opens the output file and maps the input file, so the source is never copied.
+void openFiles(char * inputFile, char * outputFile)
+{
+	struct stat info;
+	int fd;
+
+	outFile = fopen(outputFile, "w");
+
+	fd = open(inputFile, O_RDONLY);
+	if (fd < 0 || fstat(fd, &info) < 0)
 	{
-		throwError("Input file ends unexpectedly! (Did you forget to close a comment?)");
+		throwError("Could not open the input file!");
 	}
 
-	char nextChar = inputChars[ip];
-	ip++;
-	
-	if (!ignoreValidity && !isValid(nextChar))
+	//An empty file cannot be mapped
+	inputCharsSize = info.st_size;
+	inputChars = "";
+	if (inputCharsSize > 0)
 	{
-		throwError("Invalid character encountered!");
+		void * map = mmap(NULL, inputCharsSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			throwError("Could not map the input file!");
+		}
+		inputChars = map;
 	}
-	return nextChar;
+	close(fd);
 }
 
-//Go back!!!
-void ungetChar()
-{
-	ip--;
-}
+//~~~Identifier interning~~~
+
+//Distinct identifiers in order of first appearance, indexed by id
+Identifier * identifiers;
+int identifierCount;
+int identifierMax;
 
-//The almighty buffer, and associates
-int bp;
-char buffer[16];
+//Open-addressed table of ids plus one, 0 for an empty slot; its size is a power of two
+int * internSlots;
+int internSize;
 
-//Empty out that buffer!
-void clearBuffer()
+//FNV-1a hash of the [length] characters at [name]
+unsigned internHash(const char * name, int length)
 {
-	bp = 0;
-	for(int i = 0; i < 16; i++)
+	unsigned hash = 2166136261u;
+
+	for(int i = 0; i < length; i++)
 	{
-		buffer[i] = '\0';
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
 	}
+	return hash;
 }
 
-//Add [theChar] to the end of the buffer!
-void addToBuffer(char theChar)
+//Forget the identifiers of any earlier scan!
+void clearIdentifiers()
 {
-	if (bp < 16)
-	{
-		buffer[bp] = theChar;
-		bp++;
-	}
+	identifierCount = 0;
+	if (internSlots != NULL)
+		memset(internSlots, 0, internSize * sizeof(int));
 }
 
-//This method opens the input and output files, and also reads in all the data from the input file.
-void openFiles(char * inputFile, char * outputFile)
+//Double the slot table and put every identifier back in.
+void growIntern()
 {
-	FILE * inFile = fopen(inputFile, "r");
-	outFile = fopen(outputFile, "w");
+	int size = internSize ? 2 * internSize : 1024;
+	int * slots = calloc(size, sizeof(int));
 
-	fseek(inFile, 0, SEEK_END);
-	int inputSize = ftell(inFile);
-	inputCharsSize = inputSize;
-	fseek(inFile, 0, SEEK_SET);
-	int i;
-	for(i = 0; i < inputSize; i++)
+	if (slots == NULL)
+		throwError("Out of memory!");
+
+	for(int id = 0; id < identifierCount; id++)
 	{
-		fscanf(inFile, "%c", &inputChars[i]);
+		unsigned h = internHash(identifiers[id].name, identifiers[id].length);
+		while (slots[h & (size - 1)])
+			h++;
+		slots[h & (size - 1)] = id + 1;
 	}
-	inputChars[i] = '\0';
-	fclose(inFile);
-}
 
-//~~~Text processing~~~
-char lexemeTable[MAX_CODE_LENGTH];
-char lexemeList[MAX_CODE_LENGTH];
-char symbolicLexemeList[MAX_CODE_LENGTH];
+	free(internSlots);
+	internSlots = slots;
+	internSize = size;
+}
 
-//Overwrite all data in the lexeme output arrays!
-void clearLexemeOutput()
+//Returns the id of the identifier of [length] characters at [name], adding it if it is new.
+//The name is kept by reference, so it must outlive the identifier.
+int internIdentifier(const char * name, int length)
 {
-	for(int i = 0; i < MAX_CODE_LENGTH; i++)
+	unsigned h;
+	int id;
+
+	//Keep the table at most half full
+	if (2 * (identifierCount + 1) > internSize)
+		growIntern();
+
+	for(h = internHash(name, length); (id = internSlots[h & (internSize - 1)]); h++)
 	{
-		lexemeTable[i] = '\0';
-		lexemeList[i] = '\0';
-		symbolicLexemeList[i] = '\0';
+		if (identifiers[id - 1].length == length && memcmp(identifiers[id - 1].name, name, length) == 0)
+			return id - 1;
 	}
-	strcat(lexemeTable, "Lexeme Table:\nlexeme       token type\n");
-	strcat(lexemeList, "Lexeme List:\n");
-	strcat(symbolicLexemeList, "Symbolic Lexeme List:\n");
-}
 
-//Insert the lexeme [lexeme] of type [tokenType] nicely into the lexeme table.
-void insertToLexemeTable(char * lexeme, int tokenType)
-{
-	char temp[64];
-	char spaces[64] = {'\0'};
-	while(strlen(lexeme) + strlen(spaces) < 13)
-		strcat(spaces, " ");
-	sprintf(temp, "%s%s%d\n", lexeme, spaces, tokenType);
-	strcat(lexemeTable, temp);
-}
+	if (identifierCount == identifierMax)
+	{
+		Identifier * grown = realloc(identifiers, (identifierMax ? 2 * identifierMax : 1024) * sizeof(Identifier));
+		if (grown == NULL)
+			throwError("Out of memory!");
+		identifiers = grown;
+		identifierMax = identifierMax ? 2 * identifierMax : 1024;
+	}
 
-//Insert a number into the lexeme list!
-void insertIntToLexemeList(int num)
-{
-	char temp[64];
-	sprintf(temp, "%d ", num);
-	strcat(lexemeList, temp);
-	sprintf(temp, "%s ", IRMapping[num]);
-	strcat(symbolicLexemeList, temp);
+	identifiers[identifierCount].name = name;
+	identifiers[identifierCount].length = length;
+	internSlots[h & (internSize - 1)] = identifierCount + 1;
+	return identifierCount++;
 }
 
-//Insert a string into the lexeme list!
-void insertStrToLexemeList(char * identifier)
+//~~~Text processing~~~
+Token * tokens;
+int tokenCount;
+int tokenMax;
+
+//Source offset of the lexeme being scanned
+size_t tokenStart;
+
+//Forget the tokens of any earlier scan!
+void clearTokens()
 {
-	char temp[64];
-	sprintf(temp, "%s ", identifier);
-	strcat(lexemeList, temp);
-	strcat(symbolicLexemeList, temp);
+	tokenCount = 0;
 }
 
-//Take [identifier] and see if it's a reserved word or actually just an identifier...
-void processIdentifier(char * identifier)
+//Append a token of type [kind] for the lexeme starting at tokenStart and ending before ip.
+void addToken(int kind, int value)
 {
-	int index = reservedIndex(identifier);
-	if (index > -1)
+	if (tokenCount == tokenMax)
 	{
-		//It's reserved!
-		int mapping = mapReserved(index);
-		insertIntToLexemeList(mapping);
-		insertToLexemeTable(identifier, mapping);
+		Token * grown = realloc(tokens, (tokenMax ? 2 * tokenMax : 1024) * sizeof(Token));
+		if (grown == NULL)
+			throwError("Out of memory!");
+		tokens = grown;
+		tokenMax = tokenMax ? 2 * tokenMax : 1024;
 	}
-	else
+
+	tokens[tokenCount].kind = kind;
+	tokens[tokenCount].value = value;
+	tokens[tokenCount].offset = tokenStart;
+	tokens[tokenCount].length = ip - tokenStart;
+	tokens[tokenCount].line = lineNumber;
+	tokenCount++;
+}
+
+//Print the lexeme list: token types, each identifier and number followed by its lexeme.
+void printLexemeList(FILE * out)
+{
+	fprintf(out, "Lexeme List:\n");
+	for(int i = 0; i < tokenCount - 1; i++)
 	{
-		//Not reserved!
-		insertIntToLexemeList(2);
-		insertStrToLexemeList(identifier);
-		insertToLexemeTable(identifier, 2);
+		fprintf(out, "%d ", tokens[i].kind);
+		if (tokens[i].kind == identsym || tokens[i].kind == numbersym)
+			fprintf(out, "%.*s ", tokens[i].length, &inputChars[tokens[i].offset]);
 	}
 }
 
-
-//Process a number literal represented by the string pointed to by [num]
-void processNumber(char * num)
+//Print the lexeme list with token types by name.
+void printSymbolicLexemeList(FILE * out)
 {
-	insertToLexemeTable(num, 3);
-	insertIntToLexemeList(3);
-	insertStrToLexemeList(num);
+	fprintf(out, "Symbolic Lexeme List:\n");
+	for(int i = 0; i < tokenCount - 1; i++)
+	{
+		fprintf(out, "%s ", IRMapping[tokens[i].kind]);
+		if (tokens[i].kind == identsym || tokens[i].kind == numbersym)
+			fprintf(out, "%.*s ", tokens[i].length, &inputChars[tokens[i].offset]);
+	}
 }
 
-//Process a symbol represented by the string pointed to by [sym]
-void processSymbol(char * sym)
+//Print every lexeme next to its token type.
+void printLexemeTable(FILE * out)
 {
-	insertToLexemeTable(sym, mapSymbol(sym));
-	insertIntToLexemeList(mapSymbol(sym));
+	fprintf(out, "Lexeme Table:\nlexeme       token type\n");
+	for(int i = 0; i < tokenCount - 1; i++)
+	{
+		fprintf(out, "%-13.*s%d\n", tokens[i].length, &inputChars[tokens[i].offset], tokens[i].kind);
+	}
 }
 
+//Print the lexeme lists the way out.txt shows them.
+void printLexemes(FILE * out)
+{
+	//Uncomment this to print out the lexeme table as well...
+	//printLexemeTable(out);
+	//fprintf(out, "\n");
 
+	printSymbolicLexemeList(out);
+	fprintf(out, "\n\n");
+	printLexemeList(out);
+}
 
 //The meat of the program, where the actual fancy important scanning stuff happens!
 void processText()
 {
-	//Clear out the output arrays...
-	clearLexemeOutput();
+	const unsigned char * src = (const unsigned char *) inputChars;
+	int state = S_START, next, value;
+
+	//Pick the bulk scanner if none is set
+	scannerName();
 
-	//Run through the input characters...
-	char nextChar = ' ';
-	while(nextChar != '\0')
+	//Start over on the whole input...
+	clearTokens();
+	clearIdentifiers();
+	ip = 0;
+	lineNumber = 1;
+
+	for(;;)
 	{
-		clearBuffer();
-		while(isInvisible(nextChar = getChar(0)))
-		{
-			//Trash the invisible characters
-		}
+		next = transitions[state][(ip < inputCharsSize) ? charClass[src[ip]] : C_EOF];
 
-		//It's not invisible if we are here!
-		if (isAlpha(nextChar))
+		//Still scanning: take the character
+		if (next < F_SYMBOL)
 		{
-			addToBuffer(nextChar);
-			while(isAlphanumeric(nextChar = getChar(0)))
-			{
-				addToBuffer(nextChar);
-				if (strlen(buffer) > MAX_IDENTIFIER_LENGTH)
-				{
-					//Invalid identifier length
-					throwError("Identifier too long!");
-				}
-			}
-			ungetChar();
-			//Process identifier in buffer
-			processIdentifier(buffer);
+			if (state == S_START)
+				tokenStart = ip;
+			if (src[ip] == '\n')
+				lineNumber++;
+			ip++;
+			state = next;
+
+			//Skip the rest of a run in bulk, unless it has already ended
+			if (ip >= inputCharsSize || transitions[state][charClass[src[ip]]] != state)
+				continue;
+			if (state == S_START)
+				ip = scanner->space(src, ip, inputCharsSize, &lineNumber);
+			else if (state == S_IDENT)
+				ip = scanner->word(src, ip, inputCharsSize);
+			else if (state == S_NUMBER)
+				ip = scanner->digits(src, ip, inputCharsSize);
+			else if (state == S_COMMENT)
+				ip = scanner->comment(src, ip, inputCharsSize, &lineNumber);
+			continue;
 		}
-		else if (isDigit(nextChar))
+
+		if (state == S_START)
+			tokenStart = ip;
+
+		//Lengths are checked before whatever ended the lexeme
+		if (state == S_IDENT && ip - tokenStart > MAX_IDENTIFIER_LENGTH)
+			throwError("Identifier too long!");
+		if (state == S_NUMBER && ip - tokenStart > MAX_NUMBER_LENGTH)
+			throwError("Number too long!");
+
+		switch(next)
 		{
-			addToBuffer(nextChar);
-			while(isDigit(nextChar = getChar(0)))
-			{
-				addToBuffer(nextChar);
-				if (strlen(buffer) > MAX_NUMBER_LENGTH)
+			case F_SYMBOL:
+				ip++;
+				addToken(symbolKind[src[ip - 1]], 0);
+				break;
+			case F_IDENT:
+				//The token's span is its name, and its value the name's id
+				value = keywordKind(&inputChars[tokenStart], ip - tokenStart);
+				addToken(value, (value == identsym) ? internIdentifier(&inputChars[tokenStart], ip - tokenStart) : 0);
+				break;
+			case F_NUMBER:
+				value = 0;
+				for(size_t i = tokenStart; i < ip; i++)
 				{
-					//Invalid number length
-					throwError("Number too long!");
+					value = 10 * value + src[i] - '0';
 				}
-			}
-			//Was this number followed by a letter?
-			if (isAlpha(nextChar))
-			{
+				addToken(numbersym, value);
+				break;
+			case F_LSS:
+				addToken(lessym, 0);
+				break;
+			case F_LEQ:
+				ip++;
+				addToken(leqsym, 0);
+				break;
+			case F_NEQ:
+				ip++;
+				addToken(neqsym, 0);
+				break;
+			case F_GTR:
+				addToken(gtrsym, 0);
+				break;
+			case F_GEQ:
+				ip++;
+				addToken(geqsym, 0);
+				break;
+			case F_BECOMES:
+				ip++;
+				addToken(becomesym, 0);
+				break;
+			case F_SLASH:
+				addToken(slashsym, 0);
+				break;
+			case F_END:
+				//Mark the end of input
+				addToken(nulsym, 0);
+				return;
+			case E_CHAR:
+				throwError("Invalid character encountered!");
+				break;
+			case E_NUMBER_LETTER:
 				throwError("Identifier does not start with letter!");
-			}
-			//It was not followed by a letter.. so we are okay!
-			ungetChar();
-			//Process number in buffer.
-			processNumber(buffer);
-		}
-		else if (isSymbol(nextChar))
-		{
-			addToBuffer(nextChar);
-			if (nextChar == '+' || nextChar == '-' || nextChar == '*' || nextChar == '(' || nextChar == ')' || nextChar == '=' || nextChar == ',' || nextChar == '.' || nextChar == ';')
-			{
-				//Process just that symbol itself!
-				processSymbol(buffer);
-			}
-			else if (nextChar == '/')
-			{
-				nextChar = getChar(0);
-				if (nextChar == '*')
-				{
-					state5:
-					while((nextChar = getChar(1)) != '*')
-					{
-						//Dump comment...
-					}
-					while((nextChar = getChar(1)) == '*')
-					{
-						//Dump comment...
-					}
-					if (nextChar == '/')
-					{
-						//Done with comment!
-					}
-					else
-					{
-						//Still in comment from * to another char...
-						goto state5;
-					}
-				}
-				else
-				{
-					//Process as a divide symbol...
-					ungetChar();
-					processSymbol(buffer);
-				}
-			}
-			else if (nextChar == '<')
-			{
-				nextChar = getChar(0);
-				if (nextChar == '=')
-				{
-					addToBuffer(nextChar);
-					processSymbol(buffer);
-				}
-				else if (nextChar == '>')
-				{
-					addToBuffer(nextChar);
-					processSymbol(buffer);
-				}
-				else
-				{
-					//Process less only
-					ungetChar();
-					processSymbol(buffer);
-				}
-			}
-			else if (nextChar == '>')
-			{
-				nextChar = getChar(0);
-				if (nextChar == '=')
-				{
-					addToBuffer(nextChar);
-					processSymbol(buffer);
-				}
-				else
-				{
-					//Process greater than only
-					ungetChar();
-					processSymbol(buffer);
-				}
-			}
-			else if (nextChar == ':')
-			{
-				//We must have an equal following it!
-				nextChar = getChar(0);
-				if (nextChar == '=')
-				{
-					addToBuffer(nextChar);
-					processSymbol(buffer);
-				}
-				else
-				{
-					throwError("Invalid symbol!");
-				}
-			}
-
-		}
-		else if (nextChar == '\0')
-		{
-			break;
-		}
-		else
-		{
-			//Invalid state
-			throwError("Invalid state!");
+				break;
+			case E_SYMBOL:
+				throwError("Invalid symbol!");
+				break;
+			case E_COMMENT:
+				throwError("Input file ends unexpectedly! (Did you forget to close a comment?)");
+				break;
 		}
+		state = S_START;
 	}
-
-	//Print results to output file...
-	
-	//Uncomment this to print out the lexeme table as well...
-	//fprintf(outFile, "%s\n", lexemeTable);
-	
-	fprintf(outFile, "%s\n\n", symbolicLexemeList);
-	fprintf(outFile, "%s", lexemeList);
 }
 
 void echoInput()
 {
-	fprintf(outFile, "Source Program:\n%s\n\n", inputChars);
+	fprintf(outFile, "Source Program:\n");
+	fwrite(inputChars, 1, inputCharsSize, outFile);
+	fprintf(outFile, "\n\n");
 }
 
 // int main(int argc, char ** argv)
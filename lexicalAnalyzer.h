@@ -4,23 +4,55 @@
 #define MAX_NUMBER_LENGTH 5
 #define MAX_IDENTIFIER_LENGTH 11
 
-#define MAX_CODE_LENGTH 32768
+//Token types
+enum {
+	nulsym = 1, identsym, numbersym, plussym,
+	minussym, multsym, slashsym, oddsym, eqlsym,
+	neqsym, lessym, leqsym, gtrsym, geqsym,
+	lparentsym, rparentsym, commasym, semicolonsym,
+	periodsym, becomesym, beginsym, endsym, ifsym,
+	thensym, whilesym, dosym, callsym, constsym,
+	varsym, procsym, writesym, readsym, elsesym
+};
 
-extern int nulsym, identsym, numbersym, plussym,
-minussym, multsym, slashsym, oddsym, eqlsym,
-neqsym, lessym, leqsym, gtrsym, geqsym,
-lparentsym, rparentsym, commasym, semicolonsym,
-periodsym, becomesym, beginsym, endsym, ifsym,
-thensym, whilesym, dosym, callsym, constsym,
-varsym, procsym, writesym, readsym, elsesym;
+//A scanned token; the lexeme lists are renderings of the token array
+typedef struct Token {
+	int kind;		//Token type, e.g. identsym
+	int value;		//Number value, or an identifier's id
+	size_t offset;	//Span of the lexeme in inputChars; an identifier's name
+	int length;
+	int line;
+} Token;
 
-extern char lexemeList[MAX_CODE_LENGTH];
-extern char symbolicLexemeList[MAX_CODE_LENGTH];
+//A distinct identifier; the name is in inputChars, or a string the parser interned
+typedef struct Identifier {
+	const char * name;
+	int length;
+} Identifier;
+
+//Tokens of the source, ending with a nulsym token
+extern Token * tokens;
+extern int tokenCount;
+
+//Identifiers of the source, indexed by id
+extern Identifier * identifiers;
+extern int identifierCount;
+
+//The source, mapped read-only
+extern const char * inputChars;
+extern size_t inputCharsSize;
 
 extern FILE * outFile;
 
 void openFiles(char * inputFile, char * outputFile);
 void echoInput();
 void processText();
+int setScanner(const char * name);
+const char * scannerName();
+int internIdentifier(const char * name, int length);
+void printLexemes(FILE * out);
+void printLexemeList(FILE * out);
+void printSymbolicLexemeList(FILE * out);
+void printLexemeTable(FILE * out);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "module.h"
+
+// The mapped instruction array is used as inst directly
+typedef char inst_layout_check[(sizeof(inst) == 3 * sizeof(int32_t)) ? 1 : -1];
+
+// Write a module holding count instructions and an optional debug section
+int module_write(FILE *out, const int (*code)[3], uint32_t count, uint32_t stack_size,
+	uint32_t cell_bits, const void *debug, uint32_t debug_size)
+{
+	ModuleHeader hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MODULE_MAGIC, 4);
+	hdr.version = MODULE_VERSION;
+	hdr.inst_size = sizeof(inst);
+	hdr.inst_count = count;
+	hdr.stack_size = stack_size;
+	hdr.cell_bits = cell_bits;
+
+	if(debug && debug_size)
+	{
+		hdr.debug_offset = sizeof(hdr) + count * sizeof(inst);
+		hdr.debug_size = debug_size;
+	}
+
+	if(fwrite(&hdr, sizeof(hdr), 1, out) != 1
+		|| fwrite(code, sizeof(inst), count, out) != count
+		|| (hdr.debug_offset && fwrite(debug, 1, debug_size, out) != debug_size))
+		return 0;
+
+	return fflush(out) == 0;
+}
+
+// Map a module; returns NULL if path is not a valid module
+Module *module_open(const char *path)
+{
+	struct stat st;
+	ModuleHeader *hdr;
+	Module *m;
+	void *p;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(ModuleHeader)
+		|| (p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	hdr = p;
+	if(memcmp(hdr->magic, MODULE_MAGIC, 4) || hdr->version != MODULE_VERSION
+		|| hdr->inst_size != sizeof(inst)
+		|| (hdr->cell_bits != 16 && hdr->cell_bits != 32 && hdr->cell_bits != 64)
+		|| sizeof(ModuleHeader) + (size_t) hdr->inst_count * sizeof(inst) > st.st_size
+		|| (size_t) hdr->debug_offset + hdr->debug_size > st.st_size
+		|| !(m = calloc(1, sizeof(Module))))
+	{
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	m->hdr = hdr;
+	m->code = (inst *) (hdr + 1);
+	m->debug = hdr->debug_offset ? (unsigned char *) p + hdr->debug_offset : NULL;
+	m->map_len = st.st_size;
+	return m;
+}
+
+// Append a chunk to a debug section being built; returns the grown section, or NULL
+unsigned char *module_add_section(unsigned char *debug, uint32_t *debug_size,
+	uint32_t tag, const void *data, uint32_t size)
+{
+	uint32_t chunk[2] = { tag, size }, padded = (size + 3) & ~3u;
+	unsigned char *p;
+
+	if( !(p = realloc(debug, *debug_size + sizeof(chunk) + padded)) )
+	{
+		free(debug);
+		return NULL;
+	}
+
+	memcpy(p + *debug_size, chunk, sizeof(chunk));
+	memcpy(p + *debug_size + sizeof(chunk), data, size);
+	memset(p + *debug_size + sizeof(chunk) + size, 0, padded - size);
+	*debug_size += sizeof(chunk) + padded;
+	return p;
+}
+
+// Find the debug chunk tagged tag; returns NULL if there is none
+const void *module_section(const Module *m, uint32_t tag, uint32_t *size)
+{
+	const unsigned char *p = m->debug;
+	uint32_t off = 0, chunk[2];
+
+	while(p && off + sizeof(chunk) <= m->hdr->debug_size)
+	{
+		memcpy(chunk, p + off, sizeof(chunk));
+		off += sizeof(chunk);
+
+		if(chunk[1] > m->hdr->debug_size - off)
+			break;
+
+		if(chunk[0] == tag)
+		{
+			if(size) *size = chunk[1];
+			return p + off;
+		}
+		off += (chunk[1] + 3) & ~3u;
+	}
+	return NULL;
+}
+
+void module_close(Module *m)
+{
+	if(!m) return;
+	munmap(m->hdr, m->map_len);
+	free(m);
+}
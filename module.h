@@ -0,0 +1,77 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+#define MODULE_MAGIC "PM0B"
+#define MODULE_VERSION 3
+#define MODULE_FILE "vminput.pm0"
+
+/* Debug section chunks */
+#define MODULE_TAG(a, b, c, d) \
+	((uint32_t) (a) | (uint32_t) (b) << 8 | (uint32_t) (c) << 16 | (uint32_t) (d) << 24)
+#define MODULE_LINES MODULE_TAG('L', 'I', 'N', 'E')	// uint32 source line per instruction
+#define MODULE_PROCS MODULE_TAG('P', 'R', 'O', 'C')	// ModuleProc per procedure
+#define MODULE_STATE MODULE_TAG('S', 'T', 'A', 'T')	// ModuleState of a suspended run
+
+/*
+	A compiled program: this header, then inst_count packed {op, l, m}
+	int32 triples laid out exactly like inst, then an optional debug
+	section of tagged chunks, each {uint32 tag, uint32 size, data} with
+	data padded to 4 bytes.
+*/
+typedef struct ModuleHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t inst_size;		// sizeof(inst) of the writer
+	uint32_t inst_count;
+	uint32_t stack_size;	// Cells to run with, 0 for the VM default
+	uint32_t debug_offset;	// From the start of the file, 0 if absent
+	uint32_t debug_size;
+	uint32_t cell_bits;		// Stack cell width the VM runs with: 16, 32 or 64
+} ModuleHeader;
+
+typedef struct ModuleProc {
+	int32_t adr;			// Code index the procedure is called at
+	char name[12];
+} ModuleProc;
+
+/*
+	Registers of a run suspended by vm_save(), followed by int32
+	stack[stack_len], display[level + 1], then ar_start, saved_level,
+	saved_display and ret_push, top_ari entries each.
+*/
+typedef struct ModuleState {
+	uint32_t bp;
+	uint32_t sp;
+	uint32_t pc;
+	int32_t level;
+	int32_t top_ari;
+	uint32_t stack_len;		// Cells saved from the bottom of the stack
+	int32_t io;
+	int32_t fusion;			// Code holds superinstructions
+	uint64_t input_pos;		// Batch input values consumed
+	int64_t out_pos;		// Bytes of output written, -1 if unknown
+	uint64_t steps;
+	uint64_t fused_steps;
+} ModuleState;
+
+typedef struct Module {
+	ModuleHeader *hdr;
+	inst *code;				// Private mapping; writes never reach the file
+	const unsigned char *debug;
+	size_t map_len;
+} Module;
+
+int module_write(FILE *out, const int (*code)[3], uint32_t count, uint32_t stack_size,
+	uint32_t cell_bits, const void *debug, uint32_t debug_size);
+Module *module_open(const char *path);
+unsigned char *module_add_section(unsigned char *debug, uint32_t *debug_size,
+	uint32_t tag, const void *data, uint32_t size);
+const void *module_section(const Module *m, uint32_t tag, uint32_t *size);
+void module_close(Module *m);
+
+#endif
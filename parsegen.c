@@ -5,6 +5,8 @@
 #include "parsegen.h"
 #include "lexicalAnalyzer.h"
 #include "symboltable.h"
+#include "module.h"
+#include "aot.h"
 
 enum opcodes {	NON, LIT, OPR, LOD, STO, 
 				CAL, INC, JMP, JPC, SIO 	};
@@ -57,32 +59,43 @@ void error(const char * message)
 
 // Code generation stuff
 static int cx; // code index
-static int code[MAX_CODE_LENGTH][3];
-static int stack_size = 0;
+static int (*code)[3];
+static int code_max;
 
-void update_stack_size(int op, int lvl, int m)
+// Debug info: source line of each instruction and the procedure entry points
+static uint32_t *code_line;
+static int cur_line;
+static ModuleProc *procs;
+static int num_procs;
+
+// Make room for n more instructions
+void reserve_code(int n)
 {
-	if(op == LIT || op == LOD || (op == SIO && m == REA))
-		stack_size++;
-	else if(op == STO || op == JPC || (op == SIO && m == WRT))
-		stack_size--;
-	else if(op == INC)
-		stack_size += m;
-	else if(op == OPR)
-		if(m == RET) stack_size = 0;
-		else if (m != NEG && m != ODD) stack_size--;
+	int (*c)[3];
+	uint32_t *l;
+
+	if(cx + n <= code_max) return;
+
+	while(cx + n > code_max) code_max = code_max ? 2 * code_max : 1024;
+
+	if(!(c = realloc(code, code_max * sizeof(code[0]))))
+		error("Out of memory.");
+	code = c;
+
+	if(!(l = realloc(code_line, code_max * sizeof(code_line[0]))))
+		error("Out of memory.");
+	code_line = l;
 }
 
 void emit(int op, int lvl, int m)
 {
-	if(cx >= MAX_CODE_LENGTH) 
-		error("Exceeded MAX_CODE_LENGTH.");
+	reserve_code(1);
 
 	code[cx][0] = op;
 	code[cx][1] = lvl;
 	code[cx][2] = m;
+	code_line[cx] = cur_line;
 	cx++;
-	update_stack_size(op, lvl, m);
 }
 
 // File stuff
@@ -93,16 +106,64 @@ void print_assembly(FILE * out)
 		fprintf(out, "%d %d %d\n", code[i][0], code[i][1], code[i][2]);
 }
 
+void add_proc(const char *name, int len, int adr)
+{
+	ModuleProc *p;
+
+	if(len > (int) sizeof(p->name) - 1) len = sizeof(p->name) - 1;
+
+	if(!(p = realloc(procs, (num_procs + 1) * sizeof(ModuleProc))))
+		error("Out of memory.");
+
+	procs = p;
+	memset(&procs[num_procs], 0, sizeof(ModuleProc));
+	memcpy(procs[num_procs].name, name, len);
+	procs[num_procs++].adr = adr;
+}
+
+// Write the generated code as a binary module, with line and procedure tables
+int write_module(FILE *out, unsigned stack_size, int cell_bits)
+{
+	unsigned char *debug = NULL;
+	uint32_t debug_size = 0;
+	int ok;
+
+	debug = module_add_section(debug, &debug_size, MODULE_LINES, code_line, cx * sizeof(uint32_t));
+	if(debug) debug = module_add_section(debug, &debug_size, MODULE_PROCS, procs, num_procs * sizeof(ModuleProc));
+	if(!debug) return 0;
+
+	ok = module_write(out, code, cx, stack_size, cell_bits, debug, debug_size);
+	free(debug);
+	return ok;
+}
+
+// Write the generated code as a C program, see aot.c
+int write_c(FILE *out, unsigned stack_size)
+{
+	return aot_write_c(out, code, cx, stack_size, procs, num_procs);
+}
+
 // Parsing stuff
 SymbolTable *symbol_table = NULL;
 static int tokval, level = -1;
-static char *tokstr = NULL;
+static const char *tokstr = NULL;	// Name of the current identifier, in the source
+static int toklen, tokid;			// and its interned id
+static int return_id;				// Id of the implicit return variable
+static const Token *tok;	// Current token in the lexer's array
 
+void get_token(const Token *t)
+{
+	tok = t;
+	tokval = t->kind;
+	tokstr = (tokval == identsym) ? &inputChars[t->offset] : NULL;
+	toklen = t->length;
+	tokid = t->value;
+}
+
+// The nulsym token ending the array is never passed
 void get_next_token()
 {
-	tokstr = strtok(NULL, " ");
-	if(sscanf(tokstr, "%d", &tokval) == 1) tokstr = NULL;
-	else tokval = 0;
+	if(tokval != nulsym) get_token(tok + 1);
 }
 void parameter_list(int num_params);
 void expression();
@@ -112,27 +173,23 @@ void factor()
 	
 	if(tokval == identsym)
 	{
-		get_next_token();
-		
 		// Generate instruction to push const or var value
-		if(s = get_symbol(symbol_table, tokstr))
+		if(s = get_symbol(symbol_table, tokid))
 			if(s->type == CONSTANT) 
 				emit(LIT, 0, s->val);
 			else if (s->type == VARIABLE) 
 				emit(LOD, level - s->lvl, s->adr);
 			else error(err[21]); // ?
 		else {
-			printf(" %s ",tokstr); error(err[11]);
+			printf(" %.*s ", toklen, tokstr); error(err[11]);
 		}
 		
 		get_next_token();
 	} 
 	else if (tokval == numbersym)
 	{
-		get_next_token();
-
 		// Generate instruction to push number literal
-		emit(LIT, 0, tokval);
+		emit(LIT, 0, tok->value);
 		get_next_token();
 	}
 	else if (tokval == lparentsym)
@@ -151,9 +208,7 @@ void factor()
 		if(tokval != identsym) 
 			error(err[14]);
 
-		get_next_token();
-
-		if(!(s = get_symbol(symbol_table, tokstr))) 
+		if(!(s = get_symbol(symbol_table, tokid))) 
 			error(err[11]);
 
 		// Generate call instruction if ident is procedure
@@ -162,10 +217,8 @@ void factor()
 		get_next_token();
 		parameter_list(s->val);
 
+		// The callee's RTN leaves its value on top
 		emit(CAL, level - s->lvl, s->adr);
-
-		// Generate instruction to recover return value
-		emit(INC, 0, 1);
 	}
 	else error(err[23]);
 }
@@ -240,37 +293,39 @@ void condition()
 	}
 }
 
+// Parameters live below the AR, where the caller pushed them: the first at -n
 int parameter_block()
 {
-	int addr = 4;
+	Symbol **params = NULL;
+	int n = 0, i;
 
 	if(tokval != lparentsym) 
 		error("Procedure must have parameters.");
 
 	get_next_token();
 
-	if(tokval == identsym)
+	while(tokval == identsym || (n && tokval == commasym))
 	{
-		get_next_token();
-		add_symbol(symbol_table, VARIABLE, tokstr, 0, level + 1, addr++);
-		get_next_token();
-
-		while(tokval == commasym)
+		if(n)
 		{
 			get_next_token();
-
 			if(tokval != identsym) error("Parameter identifier expected.");
-
-			get_next_token();
-			add_symbol(symbol_table, VARIABLE, tokstr, 0, level + 1, addr++);
-			get_next_token();
 		}
+
+		if(!(params = realloc(params, (n + 1) * sizeof(Symbol *))))
+			error("Out of memory.");
+		params[n++] = add_symbol(symbol_table, VARIABLE, tokid, 0, level + 1, 0);
+		get_next_token();
 	}
 
 	if(tokval != rparentsym) error(err[0]);
-	
+
+	// A repeated name is not declared again
+	for(i = 0; i < n; i++) if(params[i]) params[i]->adr = i - n;
+	free(params);
+
 	get_next_token();
-	return addr;
+	return n;
 }
 
 void parameter_list(int num_params)
@@ -295,14 +350,10 @@ void parameter_list(int num_params)
 		params++;
 	}
 
+	// The arguments stay pushed; they become the callee's parameters
 	if(params != num_params) 
 		error("Invalid number of parameters in call.");
 
-	while(params > 0){
-		emit(STO, 0, stack_size + 4 - 1);
-		params--;
-	}
-
 	if(tokval != rparentsym) 
 		error("Bad calling formating.");
 
@@ -311,15 +362,16 @@ void parameter_list(int num_params)
 
 void statement()
 {
-	int c1, c2;
+	int c1, c2, line = cur_line;
 	Symbol *s = NULL;
 
+	// Code for this statement maps to the line it starts on
+	cur_line = tok->line;
+
 	// Parse an expression and variable assignment
 	if(tokval == identsym)
 	{ 
-		get_next_token();
-
-		if(!(s = get_symbol(symbol_table, tokstr)))
+		if(!(s = get_symbol(symbol_table, tokid)))
 			error(err[11]);
 
 		get_next_token();
@@ -341,9 +393,7 @@ void statement()
 		if(tokval != identsym) 
 			error(err[14]);
 
-		get_next_token();
-
-		if(!(s = get_symbol(symbol_table, tokstr))) 
+		if(!(s = get_symbol(symbol_table, tokid))) 
 			error(err[11]);
 
 		// Generate call instruction if ident is procedure
@@ -352,7 +402,9 @@ void statement()
 		get_next_token();
 		parameter_list(s->val);
 		
+		// Drop the return value
 		emit(CAL, level - s->lvl, s->adr);
+		emit(INC, 0, -1);
 	}
 
 	// Parse multiple statements
@@ -422,10 +474,8 @@ void statement()
 		if(tokval != identsym) 
 			error("Identifier expected after read.");
 		
-		get_next_token();
-		
-		if(!(s = get_symbol(symbol_table, tokstr))){
-			printf(" %s ",tokstr); error(err[11]);
+		if(!(s = get_symbol(symbol_table, tokid))){
+			printf(" %.*s ", toklen, tokstr); error(err[11]);
 		}
 
 		// Generate read and store instructions
@@ -444,15 +494,85 @@ void statement()
 		expression();
 		emit(SIO, 0, WRT);
 	}
+
+	cur_line = line;
+}
+
+// Follow a chain of unconditional jumps from code index i
+int jump_target(int i)
+{
+	int hops = 0;
+
+	while(code[i][0] == JMP && hops++ < cx)
+		i = code[i][2];
+	return i;
+}
+
+/*
+	Turn "return := call p(args)" in p's own body into a jump when the 
+	assignment is the last thing p does. The arguments, already pushed
+	for the CAL, are stored over p's parameters instead, and control goes
+	straight to the body with the frame reused: no CAL, no RTN, constant
+	stack. With two or more parameters the stores need more room than
+	the CAL and STO they replace, so later code moves up and the jumps
+	into it are relocated.
+*/
+void eliminate_tail_calls(int adr, int body, int ret, int num_params)
+{
+	int i, k, grow;
+
+	for(i = body + 1; i + 1 < ret; i++)
+	{
+		// CAL p from its own body; STO 0 0 (return)
+		if(code[i][0] != CAL || code[i][1] != 1 || code[i][2] != adr
+			|| code[i+1][0] != STO || code[i+1][1] != 0 || code[i+1][2] != 0)
+			continue;
+
+		// Must be followed by the return, directly or through jumps
+		if(jump_target(i + 2) != ret)
+			continue;
+
+		grow = num_params - 1;
+		if(grow > 0)
+		{
+			reserve_code(grow);
+
+			memmove(&code[i + 2 + grow], &code[i + 2], (cx - i - 2) * sizeof(code[0]));
+			memmove(&code_line[i + 2 + grow], &code_line[i + 2], (cx - i - 2) * sizeof(code_line[0]));
+			cx += grow;
+			ret += grow;
+
+			for(k = body; k < cx; k++)
+				if((code[k][0] == JMP || code[k][0] == JPC) && code[k][2] > i)
+					code[k][2] += grow;
+		}
+
+		// Last argument is on top
+		for(k = 0; k < num_params; k++)
+		{
+			code[i+k][0] = STO;
+			code[i+k][1] = 0;
+			code[i+k][2] = -1 - k;
+			code_line[i+k] = code_line[i];
+		}
+
+		code[i+k][0] = JMP;
+		code[i+k][1] = 0;
+		code[i+k][2] = body + 1;
+		code_line[i+k] = code_line[i];
+		i += k;
+	}
 }
 
-void block(int num_locals)
+void block(int num_params)
 {
-	int n, j = cx;
-	char *tmp;
+	int n, j = cx, num_locals = 4;
+	const char *tmp;
+	int tmplen, tmpid;
 
 	level++;
 
+	cur_line = tok->line;
 	emit(JMP, 0, 0);
 
 	// Parse any constant declarations
@@ -463,9 +583,7 @@ void block(int num_locals)
 
 			if (tokval != identsym) error(err[4]);
 			
-			get_next_token();
-			
-			tmp = tokstr;
+			tmpid = tokid;
 
 			get_next_token();
 			
@@ -476,11 +594,7 @@ void block(int num_locals)
 			
 			if(tokval != numbersym) error(err[2]);
 
-			get_next_token();
-
-			if(tokstr != NULL) error("Integer expected.");
-			
-			add_symbol(symbol_table, CONSTANT, tmp, tokval, level, 0);
+			add_symbol(symbol_table, CONSTANT, tmpid, tok->value, level, 0);
 			get_next_token();
 
 		} while (tokval == commasym);
@@ -498,8 +612,7 @@ void block(int num_locals)
 
 			if(tokval != identsym) error(err[4]);
 			
-			get_next_token();
-			add_symbol(symbol_table, VARIABLE, tokstr, 0, level, num_locals++);
+			add_symbol(symbol_table, VARIABLE, tokid, 0, level, num_locals++);
 			get_next_token();
 
 		} while(tokval == commasym);
@@ -516,18 +629,20 @@ void block(int num_locals)
 
 		if(tokval != identsym) error(err[4]);
 
-		get_next_token();
 		tmp = tokstr;
+		tmplen = toklen;
+		tmpid = tokid;
 		get_next_token();
 		n = parameter_block();
-		add_symbol(symbol_table, PROCEDURE, tmp, n - 4, level, cx);
+		add_symbol(symbol_table, PROCEDURE, tmpid, n, level, cx);
+		add_proc(tmp, tmplen, cx);
 
 		if(tokval != semicolonsym) error(err[6]);
 
 		get_next_token();
 
 		// Add symbol for implicit return variable scoped for the following block
-		add_symbol(symbol_table, VARIABLE, "return", 0, level + 1, 0);
+		add_symbol(symbol_table, VARIABLE, return_id, 0, level + 1, 0);
 		block(n);
 
 		if(tokval != semicolonsym) error(err[17]);
@@ -538,13 +653,17 @@ void block(int num_locals)
 	code[j][2] = cx;
 
 	// Generate local/variable declaration instruction to increment sp
+	cur_line = tok->line;
 	emit(INC, 0, num_locals); 	
 	statement();
 
 	// Generate return instruction
-	if(level) emit(OPR, 0, RET);
+	cur_line = tok->line;
+	if(level) emit(RTN, 0, num_params);
 	else emit(SIO, 0, HLT);
 
+	if(level) eliminate_tail_calls(j, code[j][2], cx - 1, num_params);
+
 	remove_level(symbol_table, level--);
 }
 
@@ -554,18 +673,23 @@ void parse_program()
 	if(symbol_table != NULL) 
 		destroy_st(symbol_table);
 
-	symbol_table = new_st(50);
+	// Symbols are indexed by the ids the lexer gave identifiers
+	return_id = internIdentifier("return", strlen("return"));
+	symbol_table = new_st(identifierCount);
+
+	// Start over on any earlier program's code
+	cx = 0;
+	num_procs = 0;
+	add_proc("main", strlen("main"), 0);
 
 	// Get first token
-	tokstr = strtok(&lexemeList[strlen("Lexeme List:\n")], " ");
-	if(sscanf(tokstr, "%d", &tokval) == 1) tokstr = NULL;
-	else tokval = 0;
+	get_token(&tokens[0]);
 
 	// Parse main block
-	block(4);
+	block(0);
 	
 	if (tokval != periodsym) error(err[9]);
 
 	// Clean up
-	destroy_st(symbol_table);
+	symbol_table = destroy_st(symbol_table);
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 
 void parse_program();
 void print_assembly(FILE *out);
+int write_module(FILE *out, unsigned stack_size, int cell_bits);
+int write_c(FILE *out, unsigned stack_size);
 
 
 #endif
\ No newline at end of file
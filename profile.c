@@ -0,0 +1,258 @@
+/*
+	Execution profiler. The profiled loop in vm.c calls profile_step()
+	before each instruction and profile_enter()/profile_leave() after
+	each call and return. Procedure names and source lines come from the
+	debug section of the loaded module; without one, procedures are
+	named by their entry point and hot spots are reported by code index.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "module.h"
+
+#define REPORT_ROWS 10
+
+static const char * const oprsym[14] = {
+	"ret", "neg", "add", "sub", "mul", "div", "odd",
+	"mod", "eql", "neq", "lss", "leq", "gtr", "geq"
+};
+
+// Register the procedure entered at adr unless it is already known
+static int add_proc(Profile *p, const char *name, int adr)
+{
+	ProfileProc *pp;
+
+	if(adr < 0 || adr >= p->code_len) return 0;
+	if(p->proc_at[adr] >= 0) return 1;
+
+	if(!(pp = realloc(p->procs, (p->num_procs + 1) * sizeof(ProfileProc))))
+		return 0;
+
+	p->procs = pp;
+	pp = &p->procs[p->num_procs];
+	memset(pp, 0, sizeof(ProfileProc));
+	strncpy(pp->name, name, sizeof(pp->name) - 1);
+	pp->adr = adr;
+	p->proc_at[adr] = p->num_procs++;
+	return 1;
+}
+
+Profile *profile_create(const VM *vm)
+{
+	const ModuleProc *mp = NULL;
+	uint32_t size = 0;
+	char name[16];
+	Profile *p;
+	int i, n;
+
+	if(!(p = calloc(1, sizeof(Profile))))
+		return NULL;
+
+	p->code_len = vm->code_len;
+	p->max_depth = 64;
+	p->pcs = calloc(p->code_len + 1, sizeof(unsigned long long));
+	p->proc_at = malloc((p->code_len + 1) * sizeof(int));
+	p->frames = malloc(p->max_depth * sizeof(int));
+	p->entered = malloc(p->max_depth * sizeof(unsigned long long));
+
+	if(!p->pcs || !p->proc_at || !p->frames || !p->entered)
+	{
+		profile_free(p);
+		return NULL;
+	}
+
+	for(i = 0; i <= p->code_len; i++) p->proc_at[i] = -1;
+
+	// Debug info only describes the code as compiled
+	if(vm->module && vm->code_len == vm->module->hdr->inst_count)
+	{
+		if((p->lines = module_section(vm->module, MODULE_LINES, &size))
+			&& size != p->code_len * sizeof(uint32_t))
+			p->lines = NULL;
+
+		mp = module_section(vm->module, MODULE_PROCS, &size);
+		for(n = mp ? size / sizeof(ModuleProc) : 0, i = 0; i < n; i++)
+		{
+			memcpy(name, mp[i].name, sizeof(mp[i].name));
+			name[sizeof(mp[i].name)] = '\0';
+			add_proc(p, name, mp[i].adr);
+		}
+	}
+
+	// The main block and any call target the debug info does not name
+	add_proc(p, "main", 0);
+
+	for(i = 0; i < vm->code_len; i++)
+	{
+		if(vm->code[i].op == 5 || vm->code[i].op == 14)
+		{
+			snprintf(name, sizeof(name), "proc@%d", vm->code[i].m);
+			add_proc(p, name, vm->code[i].m);
+		}
+	}
+
+	// The run starts inside main
+	if(p->num_procs) profile_enter(p, 0);
+	return p;
+}
+
+void profile_enter(Profile *p, int adr)
+{
+	int k = (adr >= 0 && adr < p->code_len && p->proc_at[adr] >= 0) ? p->proc_at[adr] : 0;
+	void *f, *e;
+
+	if(p->depth == p->max_depth)
+	{
+		f = realloc(p->frames, 2 * p->max_depth * sizeof(int));
+		if(f) p->frames = f;
+		e = realloc(p->entered, 2 * p->max_depth * sizeof(unsigned long long));
+		if(e) p->entered = e;
+		if(!f || !e) return;
+		p->max_depth *= 2;
+	}
+
+	p->procs[k].calls++;
+	p->procs[k].active++;
+	p->frames[p->depth] = k;
+	p->entered[p->depth++] = p->steps;
+}
+
+void profile_leave(Profile *p)
+{
+	ProfileProc *pp;
+
+	if(!p->depth) return;
+	pp = &p->procs[p->frames[--p->depth]];
+
+	// Recursive activations are covered by the outermost one
+	if(--pp->active == 0)
+		pp->inclusive += p->steps - p->entered[p->depth];
+}
+
+// Close the activations still open when the program halted
+void profile_finish(Profile *p)
+{
+	while(p->depth) profile_leave(p);
+}
+
+static const unsigned long long *sort_counts;
+
+// Orders indexes by descending count
+static int by_count(const void *a, const void *b)
+{
+	unsigned long long x = sort_counts[*(const int *) a], y = sort_counts[*(const int *) b];
+	return (x < y) - (x > y);
+}
+
+static const ProfileProc *sort_procs;
+
+static int by_exclusive(const void *a, const void *b)
+{
+	unsigned long long x = sort_procs[*(const int *) a].exclusive;
+	unsigned long long y = sort_procs[*(const int *) b].exclusive;
+	return (x < y) - (x > y);
+}
+
+// Fill order with 0..n-1 sorted by descending counts[i]
+static int *rank(const unsigned long long *counts, int n)
+{
+	int *order, i;
+
+	if(!(order = malloc((n + 1) * sizeof(int))))
+		return NULL;
+
+	for(i = 0; i < n; i++) order[i] = i;
+	sort_counts = counts;
+	qsort(order, n, sizeof(int), by_count);
+	return order;
+}
+
+void profile_report(const Profile *p, FILE *out)
+{
+	unsigned long long ops[MAX_OPCODE + 14], *line_counts = NULL;
+	double total = p->steps ? p->steps : 1;
+	int *order, i, n, max_line = 0;
+
+	fprintf(out, "Profile: %llu instructions executed\n\n", p->steps);
+
+	// Opcodes, with OPR split into its sub-ops
+	memset(ops, 0, sizeof(ops));
+	for(i = 1; i <= MAX_OPCODE; i++) if(i != 2) ops[i - 1] = p->ops[i];
+	for(i = 0; i < 14; i++) ops[MAX_OPCODE + i] = p->oprs[i];
+
+	fprintf(out, "%-12s%-14s%s\n", "Opcode", "Count", "Share");
+	if((order = rank(ops, MAX_OPCODE + 14)))
+	{
+		for(i = 0; i < MAX_OPCODE + 14 && ops[order[i]]; i++)
+		{
+			if(order[i] < MAX_OPCODE)
+				fprintf(out, "%-12s", opsym[order[i]]);
+			else
+				fprintf(out, "opr %-8s", oprsym[order[i] - MAX_OPCODE]);
+			fprintf(out, "%-14llu%5.1f%%\n", ops[order[i]], 100.0 * ops[order[i]] / total);
+		}
+		free(order);
+	}
+
+	// Procedures by exclusive count
+	fprintf(out, "\n%-16s%-12s%-14s%-14s%s\n", "Procedure", "Calls", "Inclusive", "Exclusive", "Share");
+	if((order = malloc((p->num_procs + 1) * sizeof(int))))
+	{
+		for(i = 0; i < p->num_procs; i++) order[i] = i;
+		sort_procs = p->procs;
+		qsort(order, p->num_procs, sizeof(int), by_exclusive);
+
+		for(i = 0; i < p->num_procs && i < REPORT_ROWS && p->procs[order[i]].calls; i++)
+		{
+			const ProfileProc *pp = &p->procs[order[i]];
+			fprintf(out, "%-16s%-12llu%-14llu%-14llu%5.1f%%\n", pp->name, pp->calls,
+				pp->inclusive, pp->exclusive, 100.0 * pp->exclusive / total);
+		}
+		free(order);
+	}
+
+	// Source lines, or code indexes without a line table
+	if(p->lines)
+	{
+		for(i = 0; i < p->code_len; i++)
+			if(p->lines[i] > max_line) max_line = p->lines[i];
+
+		if(!(line_counts = calloc(max_line + 1, sizeof(unsigned long long))))
+			return;
+		for(i = 0; i < p->code_len; i++)
+			line_counts[p->lines[i]] += p->pcs[i];
+
+		fprintf(out, "\n%-12s%-14s%s\n", "Line", "Count", "Share");
+		n = max_line + 1;
+	}
+	else
+	{
+		fprintf(out, "\n%-12s%-14s%s\n", "Code index", "Count", "Share");
+		n = p->code_len;
+	}
+
+	if((order = rank(line_counts ? line_counts : p->pcs, n)))
+	{
+		const unsigned long long *counts = line_counts ? line_counts : p->pcs;
+
+		for(i = 0; i < n && i < REPORT_ROWS && counts[order[i]]; i++)
+			fprintf(out, "%-12d%-14llu%5.1f%%\n", order[i], counts[order[i]], 100.0 * counts[order[i]] / total);
+		free(order);
+	}
+
+	free(line_counts);
+}
+
+void profile_free(Profile *p)
+{
+	if(!p) return;
+	free(p->pcs);
+	free(p->proc_at);
+	free(p->procs);
+	free(p->frames);
+	free(p->entered);
+	free(p);
+}
@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+typedef struct ProfileProc {
+	char name[16];
+	int adr;					// Code index CAL enters at
+	unsigned long long calls;
+	unsigned long long inclusive;	// Steps with the procedure anywhere on the call stack
+	unsigned long long exclusive;	// Steps executed by its own code
+	int active;					// Activations on the call stack
+} ProfileProc;
+
+/* Execution counts of one run */
+typedef struct Profile {
+	unsigned long long steps;
+	unsigned long long ops[MAX_OPCODE + 1];
+	unsigned long long oprs[14];
+	unsigned long long *pcs;	// Per code index
+	const uint32_t *lines;		// Source line per code index, NULL without debug info
+	int code_len;
+
+	ProfileProc *procs;
+	int num_procs;
+	int *proc_at;				// Procedure entered at each code index, or -1
+
+	// Call stack of procedure indexes and the step count at entry
+	int *frames;
+	unsigned long long *entered;
+	int depth;
+	int max_depth;
+} Profile;
+
+Profile *profile_create(const VM *vm);
+void profile_enter(Profile *p, int adr);
+void profile_leave(Profile *p);
+void profile_finish(Profile *p);
+void profile_report(const Profile *p, FILE *out);
+void profile_free(Profile *p);
+
+// Count the instruction at pc, about to execute
+static inline void profile_step(Profile *p, int pc, const inst *i)
+{
+	p->steps++;
+	p->ops[i->op]++;
+	p->pcs[pc]++;
+	if(i->op == 2 && (unsigned) i->m < 14) p->oprs[i->m]++;
+	if(p->depth) p->procs[p->frames[p->depth - 1]].exclusive++;
+}
+
+#endif
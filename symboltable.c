@@ -1,6 +1,5 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
 #include <string.h>
 
 #include "symboltable.h"
@@ -14,149 +13,148 @@ Symbol *destroy_symbol(Symbol *sym)
 
 SymbolTable *destroy_st(SymbolTable *st)
 {
-	Symbol *tmp;
 	int i;
 
 	if(!st) return NULL;
 
-	if(st->h_list)
+	if(st->scope)
 	{
-		for(i = 0; i < st->max_hash; i++)
-		{
-			while(tmp = st->h_list[i])
-			{
-				st->h_list[i] = tmp->prev_node;
-				destroy_symbol(tmp);
-			}
-		}
-		free(st->h_list);
+		for(i = 0; i < st->size; i++)
+			destroy_symbol(st->scope[i]);
+		free(st->scope);
 	}
+	free(st->by_id);
+	free(st->level_start);
 	free(st);
 	
 	return NULL;
 }
 
-// Create new SymbolTable with an h_list capacity of max_hash
-SymbolTable *new_st(int max_hash)
+// Create new SymbolTable for identifiers with ids below num_ids
+SymbolTable *new_st(int num_ids)
 {
 	SymbolTable *st = NULL;
 
 	if( !(st = calloc(1, sizeof(SymbolTable))) ) 
 		return NULL;
 
-	st->max_hash = (max_hash < 1) ? 1 : max_hash;
+	st->num_ids = (num_ids < 1) ? 1 : num_ids;
 
-	if( !(st->h_list = (Symbol **) calloc(st->max_hash, sizeof(Symbol *))) ) 
+	if( !(st->by_id = (Symbol **) calloc(st->num_ids, sizeof(Symbol *))) ) 
 		return destroy_st(st);
 
 	return st;
 }
 
-// Hash strings with djb2 algorithm
-unsigned long hash(const char *str) 
+// Get the highest leveled symbol of identifier id
+Symbol *get_symbol(SymbolTable *st, int id)
 {
-	int c;
-	unsigned long hash = 5381;
-
-	while ((c = *str++))
-		hash = ((hash << 5) + hash) + c;
+	if( !st || id < 0 || id >= st->num_ids )
+		return NULL;
 
-	return hash;
+	return st->by_id[id];
 }
 
-// Get the highest leveled symbol called name 
-Symbol *get_symbol(SymbolTable *st, char *name)
+// Make room for one more symbol in scope and for a symbol at level lvl
+static int reserve_symbol(SymbolTable *st, int lvl)
 {
-	Symbol *tmp;
-	int h;
-
-	if( !st || !name )
-		return NULL;
+	Symbol **s;
+	int *l, n;
 
-	// Locate the list name hashes to
-	h = hash(name) % st->max_hash;
-
-	if(!(tmp = st->h_list[h])) 
-		return NULL;
-
-	// Probe the list for the first symbol called "name"
-	do
-		if( !strcmp(tmp->name, name) ) return tmp;
-	while( tmp = tmp->prev_node );
+	if(st->size == st->max_size)
+	{
+		n = st->max_size ? 2 * st->max_size : 64;
+		if( !(s = realloc(st->scope, n * sizeof(Symbol *))) )
+			return 0;
+		st->scope = s;
+		st->max_size = n;
+	}
 
-	return NULL;
+	if(lvl >= st->max_levels)
+	{
+		n = 2 * lvl + 8;
+		if( !(l = realloc(st->level_start, n * sizeof(int))) )
+			return 0;
+		for(; st->max_levels < n; st->max_levels++)
+			l[st->max_levels] = -1;
+		st->level_start = l;
+	}
+	return 1;
 }
 
-// TODO: int expand_hash_arr(SymbolTable *st); ?
-
-Symbol *add_symbol(SymbolTable *st, s_type type, char *name, int val, int lvl, int adr)
+Symbol *add_symbol(SymbolTable *st, s_type type, int id, int val, int lvl, int adr)
 {
-	int h;
-
 	Symbol *s;
 	
-	if( !st || !name ) 
+	if( !st || id < 0 || id >= st->num_ids || lvl < 0 ) 
 		return NULL;
 
-	// Check for a symbol "name" with greater or equal level
-	if( (s = get_symbol(st, name)) && s->lvl >= lvl ) 
+	// Check for a symbol "id" with greater or equal level
+	if( (s = st->by_id[id]) && s->lvl >= lvl ) 
 		return NULL;
 
-	// Create new symbol
-	if( !(s = (Symbol *) calloc(1, sizeof(Symbol))) ) 
+	if( !reserve_symbol(st, lvl) )
 		return NULL;
 
-	if( !strcpy(s->name, name) ) 
-		return destroy_symbol(s);
+	if( !(s = (Symbol *) calloc(1, sizeof(Symbol))) ) 
+		return NULL;
 
+	s->id = id;
 	s->type = type;
 	s->val = val;
 	s->lvl = lvl;
 	s->adr = adr;
 
-	// Place new symbol at the head of its hash list
-	h = hash(name) % st->max_hash;
-
-	if( st->h_list[h] ) 
-		if( st->h_list[h]->lvl <= s->lvl )
-			s->prev_node = st->h_list[h];
-		else return destroy_symbol(s);
+	// New symbol shadows any outer one of its name
+	s->prev_node = st->by_id[id];
 
-	st->size++;
+	if(st->level_start[lvl] < 0)
+		st->level_start[lvl] = st->size;
+	st->scope[st->size++] = s;
 	
-	return (st->h_list[h] = s);
+	return (st->by_id[id] = s);
 }
 
 // Remove all symbols with greater or equal level
 void remove_level(SymbolTable *st, int level)
 {
 	Symbol *tmp;
-	int i;
+	int i, n, start = st->size;
+
+	// Only symbols declared since the first of those levels can go
+	for( i = (level < 0) ? 0 : level; i < st->max_levels; i++ )
+		if( st->level_start[i] >= 0 )
+		{
+			if( st->level_start[i] < start ) start = st->level_start[i];
+			st->level_start[i] = -1;
+		}
+
+	// Newest first, so each is the innermost of its name when unlinked
+	for( i = st->size - 1; i >= start; i-- )
+		if( (tmp = st->scope[i])->lvl >= level )
+		{
+			st->by_id[tmp->id] = tmp->prev_node;
+			st->scope[i] = destroy_symbol(tmp);
+		}
 
-	for( i = 0; i < st->max_hash; i++ ) 
-		while( tmp = st->h_list[i] )
-			if(tmp->lvl >= level)
-			{
-				st->h_list[i] = tmp->prev_node;
-				destroy_symbol(tmp);
-			} 
-			else break;
+	// Keep the outer symbols declared among them, a procedure after its parameters
+	for( i = n = start; i < st->size; i++ )
+		if( (tmp = st->scope[i]) )
+		{
+			if( st->level_start[tmp->lvl] == i ) st->level_start[tmp->lvl] = n;
+			st->scope[n++] = tmp;
+		}
+	st->size = n;
 }
 
-// void print_h_list(SymbolTable *st, FILE *out)
+// void print_scope(SymbolTable *st, FILE *out)
 // {
-// 	Symbol *tmp;
 // 	int i;
 
-// 	if(!st || !st->h_list) return;
-
-// 	fprintf(out, "\n Hash     Symbols");
-// 	for(i = 0; i < st->max_hash; i++)
-// 	{
-// 		fprintf(out, "\n+----+\n|%4d|", i);
+// 	if(!st || !st->scope) return;
 
-// 		for(tmp = st->h_list[i]; tmp; tmp = tmp->prev_node)
-// 			fprintf(out, " -> (%d, %s)", tmp->lvl, tmp->name);
-// 	}
-// 	fprintf(out, "\n+----+\n");
-// }
\ No newline at end of file
+// 	fprintf(out, "\n Level    Id");
+// 	for(i = 0; i < st->size; i++)
+// 		fprintf(out, "\n%6d%6d", st->scope[i]->lvl, st->scope[i]->id);
+// 	fprintf(out, "\n");
+// }
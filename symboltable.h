@@ -1,13 +1,11 @@
 #ifndef SYMBOLTABLE_H
 #define SYMBOLTABLE_H
 
-#define NAME_BUFF_LEN 11
-
 typedef enum {CONSTANT, VARIABLE, PROCEDURE} s_type;
 
 typedef struct Symbol {
-	struct Symbol *prev_node;
-	char name[NAME_BUFF_LEN];
+	struct Symbol *prev_node;	// Outer symbol of the same name it shadows
+	int id;						// Interned identifier, see lexicalAnalyzer.h
 	int val;
 	int lvl;
 	int adr;
@@ -15,16 +13,19 @@ typedef struct Symbol {
 } Symbol;
 
 typedef struct SymbolTable {
-	Symbol **h_list;
-	int max_hash;
+	Symbol **by_id;		// Innermost symbol of each identifier
+	int num_ids;
+	Symbol **scope;		// Live symbols in order of declaration
 	int size;
-	// int top_level?
+	int max_size;
+	int *level_start;	// Index in scope of each level's first symbol, -1 if none
+	int max_levels;
 } SymbolTable;
 
-Symbol *add_symbol(SymbolTable *st, s_type type, char *name, int val, int lvl, int adr);
-Symbol *get_symbol(SymbolTable *st, char *name);
+Symbol *add_symbol(SymbolTable *st, s_type type, int id, int val, int lvl, int adr);
+Symbol *get_symbol(SymbolTable *st, int id);
 SymbolTable *destroy_st(SymbolTable *st);
-SymbolTable *new_st(int max_hash);
+SymbolTable *new_st(int num_ids);
 void remove_level(SymbolTable *st, int level);
 
 #endif
@@ -0,0 +1,229 @@
+/* 
+	Threaded interpreter over the packed stream. Each instruction's handler
+	index selects its label (OPR, SIO and RJP sub-ops have their own), so
+	dispatch is one indirect jump with no copy into ir, and an instruction
+	with its operands takes 8 bytes.
+
+	Included by vm.c once per variant: define THREADED_NAME for the function
+	name and THREADED_TRACE to 1 to build the traced variant. The untraced 
+	variant never touches out or the recorder.
+
+	THREADED_CELL, int unless defined, is the type of a stack cell, and
+	THREADED_UCELL the unsigned type links and return addresses are read
+	back as. Only int cells may be traced.
+*/
+#ifndef THREADED_CELL
+#define THREADED_CELL int
+#define THREADED_UCELL unsigned
+#endif
+
+// Walk static links in cells of this width, not through base()
+#ifdef WALK_STATIC_LINKS
+#undef FRAME
+#define FRAME(lex, b) \
+	({ unsigned b_ = (b); int l_ = (lex); for(; l_ > 0; l_--) b_ = (THREADED_UCELL) s[b_ + 1]; b_; })
+#endif
+
+static void THREADED_NAME(VM *vm, FILE *out)
+{
+	static void * const labels[NUM_HANDLERS] = {
+		[H_BAD] = &&op_bad, [H_LIT] = &&op_lit, [H_LOD] = &&op_lod, [H_STO] = &&op_sto,
+		[H_CAL] = &&op_cal, [H_INC] = &&op_inc, [H_JMP] = &&op_jmp, [H_JPC] = &&op_jpc,
+		[H_NOP] = &&op_nop,
+		[H_RET] = &&opr_ret, [H_NEG] = &&opr_neg, [H_ADD] = &&opr_add, [H_SUB] = &&opr_sub,
+		[H_MUL] = &&opr_mul, [H_DVD] = &&opr_dvd, [H_ODD] = &&opr_odd, [H_MOD] = &&opr_mod,
+		[H_EQL] = &&opr_eql, [H_NEQ] = &&opr_neq, [H_LSS] = &&opr_lss, [H_LEQ] = &&opr_leq,
+		[H_GTR] = &&opr_gtr, [H_GEQ] = &&opr_geq,
+		[H_WRT] = &&sio_wrt, [H_REA] = &&sio_rea, [H_HLT] = &&sio_hlt,
+		[H_LLO] = &&op_llo, [H_LDO] = &&op_ldo, [H_LST] = &&op_lst, [H_CLI] = &&op_cli,
+		[H_RTN] = &&op_rtn,
+		[H_RJP_ODD] = &&rjp_odd, [H_RJP_EQL] = &&rjp_eql, [H_RJP_NEQ] = &&rjp_neq,
+		[H_RJP_LSS] = &&rjp_lss, [H_RJP_LEQ] = &&rjp_leq, [H_RJP_GTR] = &&rjp_gtr,
+		[H_RJP_GEQ] = &&rjp_geq,
+		[H_END] = &&end
+	};
+
+	register unsigned lpc = vm->pc, lbp = vm->bp, lsp = vm->sp;
+	register THREADED_CELL *s = (THREADED_CELL *) vm->stack;
+	register unsigned long long nsteps = 0, nfused = 0;
+	const PackedInst *code = vm->packed, *i;
+	THREADED_CELL v;
+	int n;
+
+#if THREADED_TRACE
+	print_initial_state(vm, out);
+
+	// Traces show the instructions as loaded
+#define DISPATCH() \
+	do { \
+		i = &code[lpc]; \
+		if(lpc < vm->code_len) trace_fetch(vm, out, lpc, &vm->code[lpc]); \
+		nsteps++; \
+		lpc++; \
+		goto *labels[i->op]; \
+	} while(0)
+
+#define NEXT() \
+	do { \
+		vm->pc = lpc; vm->bp = lbp; vm->sp = lsp; \
+		trace_state(vm, out, i - code, &vm->code[i - code]); \
+		DISPATCH(); \
+	} while(0)
+#else
+#define DISPATCH() \
+	do { \
+		i = &code[lpc]; \
+		nsteps++; \
+		lpc++; \
+		goto *labels[i->op]; \
+	} while(0)
+
+#define NEXT() DISPATCH()
+#endif
+
+	DISPATCH();
+
+op_lit:
+	s[++lsp] = i->m;
+	NEXT();
+op_lod:
+	s[lsp + 1] = s[FRAME(i->l, lbp) + i->m];
+	lsp++;
+	NEXT();
+op_sto:
+	s[FRAME(i->l, lbp) + i->m] = s[lsp];
+	lsp--;
+	NEXT();
+op_cal:
+	s[lsp + 1] = 0;
+	s[lsp + 2] = FRAME(i->l, lbp);
+	s[lsp + 3] = lbp;
+	s[lsp + 4] = lpc;
+	enter_ar(vm, i->l, lsp + 1, 0);
+	lbp = lsp + 1;
+	lpc = i->m;
+	NEXT();
+op_inc:
+	lsp += i->m;
+	NEXT();
+op_jmp:
+	lpc = i->m;
+	NEXT();
+op_jpc:
+	if(s[lsp--] == 0) lpc = i->m;
+	NEXT();
+op_nop:
+	NEXT();
+
+opr_ret:
+	lsp = lbp - 1;
+	lpc = (THREADED_UCELL) s[lsp + 4];
+	lbp = (THREADED_UCELL) s[lsp + 3];
+	leave_ar(vm);
+	lsp += vm->ret_push[vm->top_ari];
+	NEXT();
+op_rtn:
+	v = s[lbp];
+	lsp = lbp - 1 - i->m;
+	lpc = (THREADED_UCELL) s[lbp + 3];
+	lbp = (THREADED_UCELL) s[lbp + 2];
+	leave_ar(vm);
+	s[++lsp] = v;
+	lsp += vm->ret_push[vm->top_ari];
+	NEXT();
+opr_neg: s[lsp] = -s[lsp]; NEXT();
+opr_add: lsp--; s[lsp] += s[lsp + 1]; NEXT();
+opr_sub: lsp--; s[lsp] -= s[lsp + 1]; NEXT();
+opr_mul: lsp--; s[lsp] *= s[lsp + 1]; NEXT();
+opr_dvd: lsp--; s[lsp] /= s[lsp + 1]; NEXT();
+opr_odd: s[lsp] %= 2; NEXT();
+opr_mod: lsp--; s[lsp] %= s[lsp + 1]; NEXT();
+opr_eql: lsp--; s[lsp] = s[lsp] == s[lsp + 1]; NEXT();
+opr_neq: lsp--; s[lsp] = s[lsp] != s[lsp + 1]; NEXT();
+opr_lss: lsp--; s[lsp] = s[lsp] < s[lsp + 1]; NEXT();
+opr_leq: lsp--; s[lsp] = s[lsp] <= s[lsp + 1]; NEXT();
+opr_gtr: lsp--; s[lsp] = s[lsp] > s[lsp + 1]; NEXT();
+opr_geq: lsp--; s[lsp] = s[lsp] >= s[lsp + 1]; NEXT();
+
+op_llo:
+	s[lsp + 1] = s[FRAME(i->l, lbp) + i->m];
+	s[lsp + 2] = i[1].m;
+	lsp += 2;
+	lpc++;
+	nfused += 2;
+	goto *labels[i[1].op];
+op_ldo:
+	s[lsp + 1] = s[FRAME(i->l, lbp) + i->m];
+	s[lsp + 2] = s[FRAME(i[1].l, lbp) + i[1].m];
+	lsp += 2;
+	lpc++;
+	nfused += 2;
+	goto *labels[i[1].op];
+op_lst:
+	s[FRAME(i->l, lbp) + i->m] = i[1].m;
+	lpc++;
+	nfused++;
+	NEXT();
+op_cli:
+	s[lsp + 1] = 0;
+	s[lsp + 2] = FRAME(i->l, lbp);
+	s[lsp + 3] = lbp;
+	s[lsp + 4] = lpc;
+	enter_ar(vm, i->l, lsp + 1, 1);
+	lbp = lsp + 1;
+	lpc = i->m;
+	nfused++;
+	NEXT();
+
+rjp_odd: nfused++; if(s[lsp--] % 2 == 0) lpc = i->m; NEXT();
+rjp_eql: nfused++; lsp -= 2; if(!(s[lsp + 1] == s[lsp + 2])) lpc = i->m; NEXT();
+rjp_neq: nfused++; lsp -= 2; if(!(s[lsp + 1] != s[lsp + 2])) lpc = i->m; NEXT();
+rjp_lss: nfused++; lsp -= 2; if(!(s[lsp + 1] < s[lsp + 2])) lpc = i->m; NEXT();
+rjp_leq: nfused++; lsp -= 2; if(!(s[lsp + 1] <= s[lsp + 2])) lpc = i->m; NEXT();
+rjp_gtr: nfused++; lsp -= 2; if(!(s[lsp + 1] > s[lsp + 2])) lpc = i->m; NEXT();
+rjp_geq: nfused++; lsp -= 2; if(!(s[lsp + 1] >= s[lsp + 2])) lpc = i->m; NEXT();
+
+sio_wrt:
+	sio_write(vm, s[lsp--]);
+	NEXT();
+sio_rea:
+	n = s[lsp + 1];
+	sio_read(vm, &n);
+	s[++lsp] = n;
+	NEXT();
+sio_hlt:
+	lpc = lbp = lsp = 0;
+	vm->run = 0;
+#if THREADED_TRACE
+	vm->pc = lpc; vm->bp = lbp; vm->sp = lsp;
+	trace_state(vm, out, i - code, &vm->code[i - code]);
+#endif
+	goto done;
+
+op_bad:
+	fprintf(stderr, "Error: Invalid op code '%d' on line %d\n", vm->code[lpc - 1].op, lpc - 1);
+	goto done;
+
+end:
+	nsteps--;	// Fell off the end of the code; nothing executed
+done:
+	vm->pc = lpc;
+	vm->bp = lbp;
+	vm->sp = lsp;
+	vm->steps += nsteps;
+	vm->fused_steps += nfused;
+
+#undef NEXT
+#undef DISPATCH
+}
+
+#ifdef WALK_STATIC_LINKS
+#undef FRAME
+#define FRAME(lex, b) base(vm, lex, b)
+#endif
+
+#undef THREADED_NAME
+#undef THREADED_TRACE
+#undef THREADED_CELL
+#undef THREADED_UCELL
+
@@ -0,0 +1,232 @@
+/*
+	Direct-threaded interpreter with top-of-stack caching. The top cell
+	stack[sp] lives in the tos register; memory below it is always current.
+	tos is spilled to stack[] only where the memory image is observed: CAL,
+	SIO, stores that may alias the top cell and trace points.
+
+	Included by vm.c once per variant, like threaded.h: define TOS_NAME for
+	the function name and TOS_TRACE to 1 to build the traced variant.
+*/
+static void TOS_NAME(VM *vm, FILE *out)
+{
+	static void * const labels[NUM_HANDLERS] = {
+		[H_BAD] = &&op_bad, [H_LIT] = &&op_lit, [H_LOD] = &&op_lod, [H_STO] = &&op_sto,
+		[H_CAL] = &&op_cal, [H_INC] = &&op_inc, [H_JMP] = &&op_jmp, [H_JPC] = &&op_jpc,
+		[H_NOP] = &&op_nop,
+		[H_RET] = &&opr_ret, [H_NEG] = &&opr_neg, [H_ADD] = &&opr_add, [H_SUB] = &&opr_sub,
+		[H_MUL] = &&opr_mul, [H_DVD] = &&opr_dvd, [H_ODD] = &&opr_odd, [H_MOD] = &&opr_mod,
+		[H_EQL] = &&opr_eql, [H_NEQ] = &&opr_neq, [H_LSS] = &&opr_lss, [H_LEQ] = &&opr_leq,
+		[H_GTR] = &&opr_gtr, [H_GEQ] = &&opr_geq,
+		[H_WRT] = &&sio_wrt, [H_REA] = &&sio_rea, [H_HLT] = &&sio_hlt,
+		[H_LLO] = &&op_llo, [H_LDO] = &&op_ldo, [H_LST] = &&op_lst, [H_CLI] = &&op_cli,
+		[H_RTN] = &&op_rtn,
+		[H_RJP_ODD] = &&rjp_odd, [H_RJP_EQL] = &&rjp_eql, [H_RJP_NEQ] = &&rjp_neq,
+		[H_RJP_LSS] = &&rjp_lss, [H_RJP_LEQ] = &&rjp_leq, [H_RJP_GTR] = &&rjp_gtr,
+		[H_RJP_GEQ] = &&rjp_geq,
+		[H_END] = &&end
+	};
+
+	register unsigned lpc = vm->pc, lbp = vm->bp, lsp = vm->sp;
+	register int *s = vm->stack;
+	register int tos = vm->stack[vm->sp];
+	register unsigned long long nsteps = 0, nfused = 0;
+	const PackedInst *code = vm->packed, *i;
+	int c;
+
+#if TOS_TRACE
+	print_initial_state(vm, out);
+
+	// Traces show the instructions as loaded
+#define DISPATCH() \
+	do { \
+		i = &code[lpc]; \
+		if(lpc < vm->code_len) trace_fetch(vm, out, lpc, &vm->code[lpc]); \
+		nsteps++; \
+		lpc++; \
+		goto *labels[i->op]; \
+	} while(0)
+
+#define NEXT() \
+	do { \
+		s[lsp] = tos; \
+		vm->pc = lpc; vm->bp = lbp; vm->sp = lsp; \
+		trace_state(vm, out, i - code, &vm->code[i - code]); \
+		DISPATCH(); \
+	} while(0)
+#else
+#define DISPATCH() \
+	do { \
+		i = &code[lpc]; \
+		nsteps++; \
+		lpc++; \
+		goto *labels[i->op]; \
+	} while(0)
+
+#define NEXT() DISPATCH()
+#endif
+
+// Push v, spilling the old top
+#define PUSH(v) do { s[lsp++] = tos; tos = (v); } while(0)
+
+// Drop the top, reloading the cell below it
+#define POP() (tos = s[--lsp])
+
+	DISPATCH();
+
+op_lit:
+	PUSH(i->m);
+	NEXT();
+op_lod:
+	s[lsp++] = tos;
+	tos = s[FRAME(i->l, lbp) + i->m];
+	NEXT();
+op_sto:
+	s[FRAME(i->l, lbp) + i->m] = tos;
+	POP();
+	NEXT();
+op_cal:
+	s[lsp] = tos;
+	s[lsp + 1] = 0;
+	s[lsp + 2] = FRAME(i->l, lbp);
+	s[lsp + 3] = lbp;
+	s[lsp + 4] = lpc;
+	enter_ar(vm, i->l, lsp + 1, 0);
+	lbp = lsp + 1;
+	lpc = i->m;
+	NEXT();
+op_inc:
+	s[lsp] = tos;
+	lsp += i->m;
+	tos = s[lsp];
+	NEXT();
+op_jmp:
+	lpc = i->m;
+	NEXT();
+op_jpc:
+	c = tos;
+	POP();
+	if(c == 0) lpc = i->m;
+	NEXT();
+op_nop:
+	NEXT();
+
+opr_ret:
+	lsp = lbp - 1;
+	lpc = s[lsp + 4];
+	lbp = s[lsp + 3];
+	leave_ar(vm);
+	lsp += vm->ret_push[vm->top_ari];
+	tos = s[lsp];
+	NEXT();
+op_rtn:
+	// The return value may be the cached top cell
+	s[lsp] = tos;
+	c = s[lbp];
+	lsp = lbp - i->m;
+	lpc = s[lbp + 3];
+	lbp = s[lbp + 2];
+	leave_ar(vm);
+	s[lsp] = c;
+	lsp += vm->ret_push[vm->top_ari];
+	tos = s[lsp];
+	NEXT();
+opr_neg: tos = -tos; NEXT();
+opr_add: tos = s[--lsp] + tos; NEXT();
+opr_sub: tos = s[--lsp] - tos; NEXT();
+opr_mul: tos = s[--lsp] * tos; NEXT();
+opr_dvd: tos = s[--lsp] / tos; NEXT();
+opr_odd: tos %= 2; NEXT();
+opr_mod: tos = s[--lsp] % tos; NEXT();
+opr_eql: tos = s[--lsp] == tos; NEXT();
+opr_neq: tos = s[--lsp] != tos; NEXT();
+opr_lss: tos = s[--lsp] < tos; NEXT();
+opr_leq: tos = s[--lsp] <= tos; NEXT();
+opr_gtr: tos = s[--lsp] > tos; NEXT();
+opr_geq: tos = s[--lsp] >= tos; NEXT();
+
+op_llo:
+	s[lsp] = tos;
+	s[lsp + 1] = s[FRAME(i->l, lbp) + i->m];
+	lsp += 2;
+	tos = i[1].m;
+	lpc++;
+	nfused += 2;
+	goto *labels[i[1].op];
+op_ldo:
+	s[lsp] = tos;
+	s[lsp + 1] = s[FRAME(i->l, lbp) + i->m];
+	lsp += 2;
+	tos = s[FRAME(i[1].l, lbp) + i[1].m];
+	lpc++;
+	nfused += 2;
+	goto *labels[i[1].op];
+op_lst:
+	// The target may be the cached top cell
+	s[lsp] = tos;
+	s[FRAME(i->l, lbp) + i->m] = i[1].m;
+	tos = s[lsp];
+	lpc++;
+	nfused++;
+	NEXT();
+op_cli:
+	s[lsp] = tos;
+	s[lsp + 1] = 0;
+	s[lsp + 2] = FRAME(i->l, lbp);
+	s[lsp + 3] = lbp;
+	s[lsp + 4] = lpc;
+	enter_ar(vm, i->l, lsp + 1, 1);
+	lbp = lsp + 1;
+	lpc = i->m;
+	nfused++;
+	NEXT();
+
+rjp_odd: nfused++; c = tos % 2; POP(); if(c == 0) lpc = i->m; NEXT();
+rjp_eql: nfused++; c = s[lsp - 1] == tos; lsp--; POP(); if(!c) lpc = i->m; NEXT();
+rjp_neq: nfused++; c = s[lsp - 1] != tos; lsp--; POP(); if(!c) lpc = i->m; NEXT();
+rjp_lss: nfused++; c = s[lsp - 1] < tos; lsp--; POP(); if(!c) lpc = i->m; NEXT();
+rjp_leq: nfused++; c = s[lsp - 1] <= tos; lsp--; POP(); if(!c) lpc = i->m; NEXT();
+rjp_gtr: nfused++; c = s[lsp - 1] > tos; lsp--; POP(); if(!c) lpc = i->m; NEXT();
+rjp_geq: nfused++; c = s[lsp - 1] >= tos; lsp--; POP(); if(!c) lpc = i->m; NEXT();
+
+sio_wrt:
+	sio_write(vm, tos);
+	POP();
+	NEXT();
+sio_rea:
+	s[lsp++] = tos;
+	sio_read(vm, &s[lsp]);
+	tos = s[lsp];
+	NEXT();
+sio_hlt:
+	s[lsp] = tos;
+	lpc = lbp = lsp = 0;
+	tos = s[0];
+	vm->run = 0;
+#if TOS_TRACE
+	vm->pc = lpc; vm->bp = lbp; vm->sp = lsp;
+	trace_state(vm, out, i - code, &vm->code[i - code]);
+#endif
+	goto done;
+
+op_bad:
+	fprintf(stderr, "Error: Invalid op code '%d' on line %d\n", vm->code[lpc - 1].op, lpc - 1);
+	goto done;
+
+end:
+	nsteps--;	// Fell off the end of the code; nothing executed
+done:
+	s[lsp] = tos;
+	vm->pc = lpc;
+	vm->bp = lbp;
+	vm->sp = lsp;
+	vm->steps += nsteps;
+	vm->fused_steps += nfused;
+
+#undef POP
+#undef PUSH
+#undef NEXT
+#undef DISPATCH
+}
+
+#undef TOS_NAME
+#undef TOS_TRACE
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+// Map a trace file; the header is followed directly by the ring
+static Trace *map_trace(int fd, size_t len, int prot)
+{
+	Trace *t;
+	void *p;
+
+	if((p = mmap(NULL, len, prot, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return NULL;
+
+	if( !(t = calloc(1, sizeof(Trace))) )
+	{
+		munmap(p, len);
+		return NULL;
+	}
+
+	t->hdr = p;
+	t->ring = (TraceRecord *) (t->hdr + 1);
+	t->map_len = len;
+	return t;
+}
+
+// Create a ring of capacity records, rounded up to a power of two, backed by the file at path
+Trace *trace_create(const char *path, uint32_t capacity)
+{
+	Trace *t;
+	uint32_t cap = 1;
+	size_t len;
+	int fd;
+
+	while(cap < capacity && cap < (1u << 31)) cap <<= 1;
+	len = sizeof(TraceHeader) + (size_t) cap * sizeof(TraceRecord);
+
+	if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		return NULL;
+
+	if(ftruncate(fd, len) < 0 || !(t = map_trace(fd, len, PROT_READ | PROT_WRITE)))
+	{
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	memcpy(t->hdr->magic, TRACE_MAGIC, 4);
+	t->hdr->version = TRACE_VERSION;
+	t->hdr->record_size = sizeof(TraceRecord);
+	t->hdr->capacity = cap;
+	t->mask = cap - 1;
+	return t;
+}
+
+// Open an existing trace read-only
+Trace *trace_open(const char *path)
+{
+	struct stat st;
+	Trace *t;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(TraceHeader) 
+		|| !(t = map_trace(fd, st.st_size, PROT_READ)))
+	{
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	// The capacity is the ring mask plus one, so it must be a power of two
+	if(memcmp(t->hdr->magic, TRACE_MAGIC, 4) || t->hdr->version != TRACE_VERSION
+		|| t->hdr->record_size != sizeof(TraceRecord)
+		|| t->hdr->capacity == 0 || (t->hdr->capacity & (t->hdr->capacity - 1))
+		|| sizeof(TraceHeader) + (size_t) t->hdr->capacity * sizeof(TraceRecord) > st.st_size)
+	{
+		trace_close(t);
+		return NULL;
+	}
+
+	t->mask = t->hdr->capacity - 1;
+	return t;
+}
+
+void trace_close(Trace *t)
+{
+	if(!t) return;
+	munmap(t->hdr, t->map_len);
+	free(t);
+}
@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "PMTR"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_CAPACITY (1 << 20)
+
+/* One executed instruction and the machine state after it */
+typedef struct TraceRecord {
+	int32_t pc;		// Code index of the instruction
+	int32_t m;
+	int32_t bp;
+	int32_t sp;
+	int32_t tos;	// stack[sp]
+	uint16_t op;
+	uint16_t l;
+} TraceRecord;
+
+typedef struct TraceHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;	// Ring size in records, a power of two
+	uint64_t count;		// Records ever written
+	int32_t final_pc;	// pc after the last record, set on close
+	int32_t reserved;
+} TraceHeader;
+
+typedef struct Trace {
+	TraceHeader *hdr;
+	TraceRecord *ring;
+	uint32_t mask;
+	size_t map_len;
+} Trace;
+
+Trace *trace_create(const char *path, uint32_t capacity);
+Trace *trace_open(const char *path);
+void trace_close(Trace *t);
+
+// Append a record, overwriting the oldest once the ring is full
+static inline void trace_record(Trace *t, int pc, int op, int l, int m, int bp, int sp, int tos)
+{
+	TraceRecord *r = &t->ring[t->hdr->count++ & t->mask];
+
+	r->pc = pc;
+	r->op = op;
+	r->l = l;
+	r->m = m;
+	r->bp = bp;
+	r->sp = sp;
+	r->tos = tos;
+}
+
+#endif
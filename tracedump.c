@@ -0,0 +1,66 @@
+/*
+	Renders a binary VM trace in the out.txt table format. The recorder
+	keeps only the top of the stack, so the stack column shows that cell.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vm.h"
+#include "trace.h"
+
+int main(int argc, char **argv)
+{
+	const TraceRecord *r;
+	FILE *out = stdout;
+	uint64_t first, i, count;
+	Trace *t;
+	int pc;
+
+	if(argc < 2 || argc > 3)
+	{
+		printf("USAGE: ./tracedump [trace file] [output file]\n");
+		return 0;
+	}
+
+	if(!(t = trace_open(argv[1])))
+	{
+		fprintf(stderr, "Error: Could not open trace %s\n", argv[1]);
+		return 0;
+	}
+
+	if(argc == 3 && !(out = fopen(argv[2], "w")))
+	{
+		fprintf(stderr, "Error: Could not open %s\n", argv[2]);
+		trace_close(t);
+		return 0;
+	}
+
+	count = t->hdr->count;
+	first = (count > t->hdr->capacity) ? count - t->hdr->capacity : 0;
+
+	fprintf(out, "%70s", "pc      bp      sp      stack\n");
+	if(first == 0)
+		fprintf(out, "%-40s%-8d%-8d%-8d\n", "Initial Values", 0, 1, 0);
+	else
+		fprintf(out, "(%llu earlier steps overwritten)\n", (unsigned long long) first);
+
+	for(i = first; i < count; i++)
+	{
+		r = &t->ring[i & t->mask];
+
+		// The pc after a step is the code index of the next step
+		pc = (i + 1 < count) ? t->ring[(i + 1) & t->mask].pc : t->hdr->final_pc;
+
+		fprintf(out, "%-8d%-8s%-8d%-16d", r->pc, 
+			(r->op >= 1 && r->op <= MAX_OPCODE) ? opsym[r->op - 1] : "???", r->l, r->m);
+		fprintf(out, "%-8d%-8d%-8d", pc, r->bp, r->sp);
+
+		if(r->sp > 0) fprintf(out, "%d ", r->tos);
+		fprintf(out, "\n");
+	}
+
+	if(out != stdout) fclose(out);
+	trace_close(t);
+	return 1;
+}
@@ -0,0 +1,352 @@
+/*
+	Load-time bytecode verifier. Code is walked from the main block and
+	from every CAL target, tracking the lexical level of each procedure
+	and the stack height relative to the AR base. verify_code() proves:
+
+	- every jump and call target is in the code, and none lands inside
+	  a superinstruction's operand slot;
+	- CAL and LOD/STO levels stay within the caller's lexical depth, and
+	  each procedure is always entered at the same level;
+	- each instruction is reached with one stack height, which never
+	  drops below what the instruction pops;
+	- each procedure returns one way, OPR 0 RET or RTN 0 n, and every
+	  CAL to an RTN 0 n procedure has its n arguments pushed;
+	- no STO or return value overwrites the static link, dynamic link or
+	  return address, and the main block never returns;
+	- every procedure's frame, and every offset it uses, stays within
+	  VERIFY_MAX_OFFSET cells of its AR base.
+
+	The code after a CAL is walked only once the callee's return is
+	known, as that decides the stack height there. With the stack between
+	two guards, verified code cannot touch memory outside the stack, so
+	the engines run it without checks.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "verify.h"
+
+typedef struct Pending {
+	int pc;
+	int height;
+	int proc;
+} Pending;
+
+/* Call waiting for its callee's return to be found */
+typedef struct Waiting {
+	int pc;
+	int height;
+	int proc;
+	int callee;
+	int push;			// Cells the call pushes after the return, 1 for CLI
+} Waiting;
+
+typedef struct Walk {
+	const inst *code;
+	int code_len;
+	char *slot;			// Operand slot of the superinstruction before it
+	int *height;		// At entry to each instruction, -1 until reached
+	int *owner;			// Procedure that reached it first
+	Pending *work;
+	int num_work;
+	int max_work;
+	Waiting *waits;
+	int num_waits;
+	Verifier *v;
+} Walk;
+
+static int fail(Walk *w, int pc, const char *error)
+{
+	w->v->error_pc = pc;
+	w->v->error = error;
+	return 0;
+}
+
+static int push_work(Walk *w, int pc, int height, int proc)
+{
+	Pending *p;
+
+	if(w->num_work == w->max_work)
+	{
+		if( !(p = realloc(w->work, 2 * w->max_work * sizeof(Pending))) )
+			return fail(w, pc, "out of memory");
+		w->work = p;
+		w->max_work *= 2;
+	}
+
+	w->work[w->num_work++] = (Pending) {pc, height, proc};
+	return 1;
+}
+
+// Procedure entered at entry from level; returns its index, or -1
+static int enter_proc(Walk *w, int pc, int entry, int level)
+{
+	Verifier *v = w->v;
+	VerifyProc *p;
+	int i;
+
+	if(entry < 0 || entry >= w->code_len)
+		return fail(w, pc, "call target out of range") - 1;
+	if(w->slot[entry])
+		return fail(w, pc, "call into an operand slot") - 1;
+	if(level >= MAX_LEXI_LEVELS)
+		return fail(w, pc, "procedure nested too deep") - 1;
+
+	for(i = 0; i < v->num_procs; i++)
+	{
+		if(v->procs[i].entry == entry)
+			return (v->procs[i].level == level) ? i : fail(w, pc, "procedure called at two levels") - 1;
+	}
+
+	if( !(p = realloc(v->procs, (v->num_procs + 1) * sizeof(VerifyProc))) )
+		return fail(w, pc, "out of memory") - 1;
+
+	v->procs = p;
+	v->procs[v->num_procs] = (VerifyProc) {entry, level, 0, RETURN_UNKNOWN};
+	return push_work(w, entry, 0, v->num_procs) ? v->num_procs++ : -1;
+}
+
+// A LOD or STO l m from a procedure at level
+static int check_ref(Walk *w, int pc, int level, int l, int m, int store, VerifyProc *p)
+{
+	if(l < 0 || l > level)
+		return fail(w, pc, "level out of range");
+	if(m <= -VERIFY_MAX_OFFSET || m >= VERIFY_MAX_OFFSET)
+		return fail(w, pc, "offset out of range");
+	if(store && m >= 1 && m <= 3)
+		return fail(w, pc, "store into an AR link");
+
+	if(l == 0 && m + 1 > p->max_depth) p->max_depth = m + 1;
+	return 1;
+}
+
+// Queue the instruction after a call at pc once the callee's return is known
+static int continue_call(Walk *w, Waiting *c)
+{
+	VerifyProc *p = &w->v->procs[c->proc];
+	int args = w->v->procs[c->callee].ret_args, after = c->height;
+
+	if(args >= 0)
+	{
+		if(c->height < args) return fail(w, c->pc, "call without its arguments");
+		after = c->height - args;
+		if(after >= 1 && after <= 3) return fail(w, c->pc, "return value into an AR link");
+		after++;
+	}
+
+	after += c->push;
+	if(after > p->max_depth) p->max_depth = after;
+	if(p->max_depth > VERIFY_MAX_OFFSET) return fail(w, c->pc, "frame too deep");
+
+	return push_work(w, c->pc + 1, after, c->proc);
+}
+
+// Procedure proc returns with args, RETURN_RET for OPR 0 RET; release its callers
+static int found_return(Walk *w, int pc, int proc, int args)
+{
+	VerifyProc *p = &w->v->procs[proc];
+	int i, n = 0;
+
+	if(p->entry == 0) return fail(w, pc, "return from the main block");
+	if(p->ret_args != RETURN_UNKNOWN)
+		return (p->ret_args == args) ? 1 : fail(w, pc, "procedure returns two ways");
+
+	p->ret_args = args;
+
+	for(i = 0; i < w->num_waits; i++)
+	{
+		if(w->waits[i].callee != proc) w->waits[n++] = w->waits[i];
+		else if(!continue_call(w, &w->waits[i])) return 0;
+	}
+	w->num_waits = n;
+	return 1;
+}
+
+// A call at pc to callee; its successor waits for the callee's return
+static int call_to(Walk *w, int pc, int h, int proc, int callee, int push)
+{
+	Waiting c = {pc, h, proc, callee, push}, *p;
+
+	if(w->v->procs[callee].ret_args != RETURN_UNKNOWN)
+		return continue_call(w, &c);
+
+	if( !(p = realloc(w->waits, (w->num_waits + 1) * sizeof(Waiting))) )
+		return fail(w, pc, "out of memory");
+
+	w->waits = p;
+	w->waits[w->num_waits++] = c;
+	return 1;
+}
+
+// Cells OPR m pops; each pushes one result
+static int opr_pops(int m)
+{
+	return (m == 1 || m == 6) ? 1 : 2;
+}
+
+// Check the instruction at pc and queue its successors
+static int step(Walk *w, int pc, int h, int proc)
+{
+	const inst *i = &w->code[pc];
+	VerifyProc *p = &w->v->procs[proc];
+	int level = p->level, next = pc + 1, k, need = 0, after = h;
+
+	switch(i->op)
+	{
+		case 1: // LIT
+			after = h + 1;
+			break;
+		case 2: // OPR
+			if((unsigned) i->m > 13) return fail(w, pc, "invalid OPR instruction");
+			if(i->m == 0) return found_return(w, pc, proc, RETURN_RET);
+			need = opr_pops(i->m);
+			after = h - need + 1;
+			break;
+		case 3: // LOD
+			if(!check_ref(w, pc, level, i->l, i->m, 0, p)) return 0;
+			after = h + 1;
+			break;
+		case 4: // STO
+			if(!check_ref(w, pc, level, i->l, i->m, 1, p)) return 0;
+			need = 1;
+			after = h - 1;
+			break;
+		case 5: // CAL
+		case CLI:
+			if(i->l < 0 || i->l > level) return fail(w, pc, "level out of range");
+			if((k = enter_proc(w, pc, i->m, level - i->l + 1)) < 0) return 0;
+			return call_to(w, pc, h, proc, k, i->op == CLI);
+		case 6: // INC
+			if((long) h + i->m < 0) return fail(w, pc, "stack underflow");
+			if((long) h + i->m > VERIFY_MAX_OFFSET) return fail(w, pc, "frame too deep");
+			after = h + i->m;
+			break;
+		case 7: // JMP
+			next = i->m;
+			break;
+		case 8: // JPC
+			need = 1;
+			after = h - 1;
+			break;
+		case 9: // SIO
+			if(i->m == 3) return 1;
+			if(i->m == 1)
+			{
+				need = 1;
+				after = h - 1;
+			}
+			else if(i->m == 2) after = h + 1;
+			break;
+		case LLO:
+		case LDO:
+			k = w->code[pc + 1].op;
+			if(k < 1 || k > 13) return fail(w, pc, "invalid fused operation");
+			if(!check_ref(w, pc, level, i->l, i->m, 0, p)) return 0;
+			if(i->op == LDO && !check_ref(w, pc, level, w->code[pc + 1].l, w->code[pc + 1].m, 0, p)) return 0;
+			after = h + 3 - opr_pops(k);
+			next = pc + 2;
+			break;
+		case RJP:
+			if(i->l < 1 || i->l > 13) return fail(w, pc, "invalid fused operation");
+			need = opr_pops(i->l);
+			after = h - need;
+			break;
+		case LST:
+			if(!check_ref(w, pc, level, i->l, i->m, 1, p)) return 0;
+			next = pc + 2;
+			break;
+		case RTN:
+			if(i->m < 0 || i->m > VERIFY_MAX_OFFSET) return fail(w, pc, "invalid return");
+			return found_return(w, pc, proc, i->m);
+		default:
+			return fail(w, pc, "invalid op code");
+	}
+
+	if(h < need) return fail(w, pc, "stack underflow");
+	if(after > p->max_depth) p->max_depth = after;
+	if(p->max_depth > VERIFY_MAX_OFFSET) return fail(w, pc, "frame too deep");
+
+	if(i->op == 7 || i->op == 8 || i->op == RJP)
+	{
+		// Running off the end halts like the engines
+		if(i->m < 0 || i->m > w->code_len) return fail(w, pc, "jump target out of range");
+		if(w->slot[i->m]) return fail(w, pc, "jump into an operand slot");
+		if(i->op != 7 && !push_work(w, i->m, after, proc)) return 0;
+	}
+	return push_work(w, next, after, proc);
+}
+
+/*
+	Verify code, which may hold superinstructions. Returns 1 with v->procs
+	describing every procedure, or 0 with error_pc and error set.
+*/
+int verify_code(const inst *code, int code_len, Verifier *v)
+{
+	Walk w = { code, code_len };
+	Pending t;
+	int i, ok = 1;
+
+	memset(v, 0, sizeof(Verifier));
+	v->error_pc = -1;
+	w.v = v;
+	w.max_work = 64;
+
+	w.slot = calloc(code_len + 1, sizeof(char));
+	w.height = malloc((code_len + 1) * sizeof(int));
+	w.owner = malloc((code_len + 1) * sizeof(int));
+	w.work = malloc(w.max_work * sizeof(Pending));
+
+	if(!w.slot || !w.height || !w.owner || !w.work)
+		ok = fail(&w, 0, "out of memory");
+
+	// Decode like the engines do to find the operand slots
+	for(i = 0; ok && i < code_len; i++)
+	{
+		w.height[i] = -1;
+		if(code[i].op == LLO || code[i].op == LDO || code[i].op == LST)
+		{
+			if(i + 1 == code_len) ok = fail(&w, i, "missing operand slot");
+			else
+			{
+				w.slot[++i] = 1;
+				w.height[i] = -1;
+			}
+		}
+	}
+
+	if(ok && code_len == 0) ok = fail(&w, 0, "no code");
+	if(ok) ok = enter_proc(&w, 0, 0, 0) == 0;
+
+	while(ok && w.num_work)
+	{
+		t = w.work[--w.num_work];
+
+		if(t.pc == code_len) continue;
+
+		if(w.height[t.pc] < 0)
+		{
+			w.height[t.pc] = t.height;
+			w.owner[t.pc] = t.proc;
+			ok = step(&w, t.pc, t.height, t.proc);
+		}
+		else if(w.height[t.pc] != t.height)
+			ok = fail(&w, t.pc, "inconsistent stack height");
+		else if(w.owner[t.pc] != t.proc)
+			ok = fail(&w, t.pc, "reached from two procedures");
+	}
+
+	free(w.slot);
+	free(w.height);
+	free(w.owner);
+	free(w.work);
+	free(w.waits);
+	return ok;
+}
+
+void verify_free(Verifier *v)
+{
+	free(v->procs);
+	v->procs = NULL;
+	v->num_procs = 0;
+}
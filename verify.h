@@ -0,0 +1,31 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "vm.h"
+
+// Frame offsets a verified procedure may reach, either way; within a guard of the stack
+#define VERIFY_MAX_OFFSET 1024
+
+// VerifyProc.ret_args before a return is found, and for OPR 0 RET
+#define RETURN_UNKNOWN -2
+#define RETURN_RET -1
+
+typedef struct VerifyProc {
+	int entry;		// Code index CAL enters at, 0 for the main block
+	int level;		// Lexical level
+	int max_depth;	// Cells of its AR the procedure ever reaches
+	int ret_args;	// n of its RTN 0 n, or RETURN_RET
+} VerifyProc;
+
+/* Result of verify_code() */
+typedef struct Verifier {
+	VerifyProc *procs;
+	int num_procs;
+	int error_pc;		// Where verification failed, -1 if it passed
+	const char *error;
+} Verifier;
+
+int verify_code(const inst *code, int code_len, Verifier *v);
+void verify_free(Verifier *v);
+
+#endif
@@ -1,122 +1,513 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "vm.h"
+#include "trace.h"
+#include "jit.h"
+#include "module.h"
+#include "profile.h"
+#include "verify.h"
 
 #define BUFFLEN 50
 
-typedef struct instruction {
-	unsigned op;
-	int l;
-	int m;
-} inst;
+/* Helper functions */
+int base(VM *vm, int lex, int base) 
+{
+	int b;
+	for(b = base; lex > 0; lex--) b = vm->stack[b + 1];
+	return b;
+}
 
-/* CPU Registers */
-static unsigned bp = 1;
-static unsigned sp = 0;
-static unsigned pc = 0;
-static inst ir;
+#ifdef WALK_STATIC_LINKS
+#define FRAME(lex, b) base(vm, lex, b)
+#else
+#define FRAME(lex, b) vm->display[vm->level - (lex)]
+#endif
 
-/* Memory Stores */
-static int code_len = 0;
-static inst code[MAX_INST_COUNT];
-static int stack[MAX_STACK_HEIGHT];
+static __thread VM *running;	// VM executing on this thread, for on_fault()
 
-static int top_ari = 0;
-static int display[MAX_STACK_HEIGHT / 4];
+// Abandon the run; vm_run() reports the overflow
+static void overflow(VM *vm)
+{
+	siglongjmp(vm->fault, 1);
+}
 
-/* Flags */
-static int run = 1;
+// Bytes of each guard around the stack
+static size_t guard_len(const VM *vm)
+{
+	return (vm->stack_map_len - (size_t) vm->stack_size * (vm->cell_bits / 8)) / 2;
+}
 
-/* Helper functions */
-int base(int lex, int base) 
+// A fault on a guard of the running VM is a stack overflow
+static void on_fault(int sig, siginfo_t *info, void *ctx)
 {
-	int b;
-	for(b = base; lex > 0; lex--) b = stack[b + 1];
-	return b;
+	VM *vm = running;
+	char *addr = info->si_addr;
+	char *start;
+
+	if(vm)
+	{
+		start = (char *) vm->stack - guard_len(vm);
+		if(addr >= start && addr < start + vm->stack_map_len)
+			overflow(vm);
+	}
+
+	// Not ours; the faulting access is retried and takes the default action
+	signal(SIGSEGV, SIG_DFL);
+}
+
+/*
+	Map the stack between two guards, so overflow needs no bounds checks.
+	Each covers every offset verified code may reach past the top cell,
+	or below cell 0 through negative parameter offsets: one page with
+	32-bit cells, more with 64-bit ones.
+*/
+static int alloc_stack(VM *vm)
+{
+	size_t page = getpagesize(), cell = vm->cell_bits / 8, len, guard;
+	char *p;
+
+	if(!vm->stack_size) vm->stack_size = DEFAULT_STACK_HEIGHT;
+
+	// 16-bit cells hold dynamic links up to 65535
+	if(vm->cell_bits == 16 && vm->stack_size > 1 << 16) vm->stack_size = 1 << 16;
+
+	len = ((size_t) vm->stack_size * cell + page - 1) / page * page;
+	guard = (VERIFY_MAX_OFFSET * cell + page - 1) / page * page;
+	vm->stack_size = len / cell;
+	vm->stack_map_len = guard + len + guard;
+
+	p = mmap(NULL, vm->stack_map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED || mprotect(p, guard, PROT_NONE) < 0 || mprotect(p + guard + len, guard, PROT_NONE) < 0)
+	{
+		if(p != MAP_FAILED) munmap(p, vm->stack_map_len);
+		return 0;
+	}
+	vm->stack = (int *) (p + guard);
+
+	// Every call takes at least the 4 cells of an AR header
+	vm->max_frames = vm->stack_size / 4 + 1;
+	if( !(vm->ar_start = calloc(4 * (size_t) vm->max_frames, sizeof(int))) )
+		return 0;
+	vm->saved_level = vm->ar_start + vm->max_frames;
+	vm->saved_display = vm->saved_level + vm->max_frames;
+	vm->ret_push = vm->saved_display + vm->max_frames;
+	return 1;
+}
+
+static void free_stack(VM *vm)
+{
+	if(vm->stack) munmap((char *) vm->stack - guard_len(vm), vm->stack_map_len);
+	free(vm->ar_start);
+	vm->stack = NULL;
+	vm->ar_start = NULL;
+}
+
+// Make ar the active AR of the callee's level, lex levels out from the caller
+void enter_ar(VM *vm, int lex, int ar, int push)
+{
+	int top = vm->top_ari++;
+
+	// Calls that never grow the stack still use a frame record
+	if(top + 1 >= vm->max_frames) overflow(vm);
+
+	vm->ret_push[top] = push;
+	vm->saved_level[top] = vm->level;
+	vm->level = vm->level - lex + 1;
+	vm->saved_display[top] = vm->display[vm->level];
+	vm->display[vm->level] = ar;
+	vm->ar_start[top] = ar;
+}
+
+// Restore the caller's level and display entry
+void leave_ar(VM *vm)
+{
+	int top = --vm->top_ari;
+
+	vm->ar_start[top] = 0;
+	vm->display[vm->level] = vm->saved_display[top];
+	vm->level = vm->saved_level[top];
+}
+
+/* Instance lifetime */
+VM *vm_create()
+{
+	VM *vm;
+
+	if( !(vm = calloc(1, sizeof(VM))) )
+		return NULL;
+
+	vm->bp = 1;
+	vm->display[0] = 1;
+	vm->run = 1;
+	vm->engine = DEFAULT_ENGINE;
+	vm->cell_bits = 32;
+	vm->in = stdin;
+	vm->out = stdout;
+	return vm;
+}
+
+// Release the loaded program
+static void unload(VM *vm)
+{
+	if(vm->module) module_close(vm->module);
+	else free(vm->code);
+
+	free(vm->packed);
+	vm->module = NULL;
+	vm->code = NULL;
+	vm->packed = NULL;
+	vm->code_len = 0;
+}
+
+void vm_destroy(VM *vm)
+{
+	if(!vm) return;
+	unload(vm);
+	free_stack(vm);
+	free(vm->input);
+	free(vm->outbuf);
+	free(vm);
+}
+
+/* Superinstruction fusion */
+// Number of code slots an instruction occupies
+int inst_width(int op)
+{
+	return (op == LLO || op == LDO || op == LST) ? 2 : 1;
+}
+
+static int is_binary_opr(const inst *i)
+{
+	return i->op == 2 && i->m >= 2 && i->m <= 13 && i->m != 6;
+}
+
+static int is_cond_opr(const inst *i)
+{
+	return i->op == 2 && (i->m == 6 || (i->m >= 8 && i->m <= 13));
+}
+
+static int is_jump(int op)
+{
+	return op == 5 || op == 7 || op == 8 || op == RJP || op == CLI;
+}
+
+// Rewrite common sequences into superinstructions, compacting code and remapping jump targets
+int fuse_code(VM *vm)
+{
+	inst *code = vm->code;
+	int code_len = vm->code_len;
+	char *target;
+	int *remap;
+	inst a, b, c;
+	int i, n = 0;
+
+	target = calloc(code_len + 1, sizeof(char));
+	remap = calloc(code_len + 1, sizeof(int));
+
+	if(!target || !remap)
+	{
+		free(target);
+		free(remap);
+		return 0;
+	}
+
+	// Sequences are only fused if no jump lands inside them
+	for(i = 0; i < code_len; i++)
+		if(is_jump(code[i].op) && code[i].m >= 0 && code[i].m <= code_len)
+			target[code[i].m] = 1;
+
+	for(i = 0; i < code_len; )
+	{
+		a = code[i];
+		b = (i + 1 < code_len) ? code[i + 1] : (inst) {0, 0, 0};
+		c = (i + 2 < code_len) ? code[i + 2] : (inst) {0, 0, 0};
+		remap[i] = n;
+
+		if(a.op == 3 && (b.op == 1 || b.op == 3) && is_binary_opr(&c) && !target[i + 1] && !target[i + 2])
+		{
+			remap[i + 1] = remap[i + 2] = n;
+			code[n++] = (inst) {(b.op == 1) ? LLO : LDO, a.l, a.m};
+			code[n++] = (inst) {c.m, b.l, b.m};
+			i += 3;
+		}
+		else if(is_cond_opr(&a) && b.op == 8 && !target[i + 1])
+		{
+			remap[i + 1] = n;
+			code[n++] = (inst) {RJP, a.m, b.m};
+			i += 2;
+		}
+		else if(a.op == 1 && b.op == 4 && !target[i + 1])
+		{
+			remap[i + 1] = n;
+			code[n++] = (inst) {LST, b.l, b.m};
+			code[n++] = (inst) {0, 0, a.m};
+			i += 2;
+		}
+		else if(a.op == 5 && b.op == 6 && b.m == 1 && !target[i + 1])
+		{
+			remap[i + 1] = n;
+			code[n++] = (inst) {CLI, a.l, a.m};
+			i += 2;
+		}
+		else 
+		{
+			code[n++] = a;
+			i++;
+		}
+	}
+	remap[code_len] = n;
+
+	for(i = 0; i < n; i += inst_width(code[i].op))
+		if(is_jump(code[i].op) && code[i].m >= 0 && code[i].m <= code_len)
+			code[i].m = remap[code[i].m];
+
+	vm->code_len = n;
+	free(target);
+	free(remap);
+	return 1;
+}
+
+/* Pre-decoding */
+
+/*
+	Handlers of the packed stream. OPR and RJP sub-ops get their own, so
+	no engine dispatches twice; H_RET + m handles OPR m.
+*/
+enum {
+	H_BAD, H_LIT, H_LOD, H_STO, H_CAL, H_INC, H_JMP, H_JPC, H_NOP,
+	H_RET, H_NEG, H_ADD, H_SUB, H_MUL, H_DVD, H_ODD,
+	H_MOD, H_EQL, H_NEQ, H_LSS, H_LEQ, H_GTR, H_GEQ,
+	H_WRT, H_REA, H_HLT,
+	H_LLO, H_LDO, H_LST, H_CLI, H_RTN,
+	H_RJP_ODD, H_RJP_EQL, H_RJP_NEQ, H_RJP_LSS, H_RJP_LEQ, H_RJP_GTR, H_RJP_GEQ,
+	H_END,
+	NUM_HANDLERS
+};
+
+static int handler(const inst *i)
+{
+	static const unsigned char ops[] = {
+		H_BAD, H_LIT, H_BAD, H_LOD, H_STO, H_CAL, H_INC, H_JMP,
+		H_JPC, H_BAD, H_LLO, H_LDO, H_BAD, H_LST, H_CLI, H_RTN
+	};
+
+	switch(i->op)
+	{
+		case 2: return ((unsigned) i->m <= 13) ? H_RET + i->m : H_BAD;
+		case 9: return (i->m >= 1 && i->m <= 3) ? H_WRT + i->m - 1 : H_NOP;
+		case RJP:
+			if(i->l == 6) return H_RJP_ODD;
+			return (i->l >= 8 && i->l <= 13) ? H_RJP_EQL + i->l - 8 : H_BAD;
+		default: return (i->op < sizeof(ops)) ? ops[i->op] : H_BAD;
+	}
+}
+
+/*
+	Translate the loaded code into 8-byte packed instructions, ending in
+	H_END. The operand slot of LLO and LDO holds the handler of their OPR.
+	Levels are truncated to 16 bits; verified code, the only code run from
+	the packed stream, stays below MAX_LEXI_LEVELS.
+*/
+static int predecode(VM *vm)
+{
+	const inst *code = vm->code;
+	PackedInst *p;
+	int n;
+
+	free(vm->packed);
+	if( !(p = vm->packed = malloc((vm->code_len + 1) * sizeof(PackedInst))) )
+	{
+		fprintf(stderr, "Error: Out of memory\n");
+		return 0;
+	}
+
+	for(n = 0; n < vm->code_len; n += inst_width(code[n].op))
+	{
+		p[n] = (PackedInst) { handler(&code[n]), code[n].l, code[n].m };
+
+		if(inst_width(code[n].op) == 2)
+			p[n + 1] = (PackedInst) { (code[n].op == LST) ? H_NOP : H_RET + code[n + 1].op,
+				code[n + 1].l, code[n + 1].m };
+	}
+	p[vm->code_len] = (PackedInst) { H_END, 0, 0 };
+	return 1;
 }
 
 /* Read/Write functions */
-int read_input(FILE *fp)
+
+// Reject op codes the engines do not handle
+// Fused code, from a snapshot, may also hold superinstructions and their operand slots
+static int check_code(const inst *code, int code_len, int fused)
 {
-	char buff[BUFFLEN];
-	int i = 0;
+	int i;
 
-	// Count the number of instructions
-	while(!feof(fp)) 
+	for(i = 0; i < code_len; i++)
 	{
-		if(fgetc(fp) == '\n')
+		if(code[i].op > MAX_OPCODE || code[i].op < 1 || (!fused && code[i].op >= LLO && code[i].op <= CLI))
+		{
+			fprintf(stderr, "Error: Invalid op code '%d' on line %d\n", code[i].op, i);
+			return 0;
+		}
+		else if(code[i].op == 2 && (unsigned) code[i].m > 13)
 		{
-			if(++code_len >= MAX_INST_COUNT) 
+			fprintf(stderr, "Error: Invalid OPR instruction '%d' on line %d.\n", code[i].m, i);
+			return 0;
+		}
+		else if(code[i].op == RJP && (unsigned) code[i].l > 13)
+		{
+			fprintf(stderr, "Error: Invalid OPR instruction '%d' on line %d.\n", code[i].l, i);
+			return 0;
+		}
+		else if(code[i].op == LLO || code[i].op == LDO || code[i].op == LST)
+		{
+			// The slot's op is the OPR of LLO and LDO
+			if(++i == code_len || (code[i - 1].op != LST && code[i].op > 13))
 			{
-				fprintf(stderr, "Error: Instruction count exceeds %d\n", MAX_INST_COUNT);
+				fprintf(stderr, "Error: Invalid operand slot on line %d\n", i);
 				return 0;
 			}
 		}
 	}
+	return 1;
+}
+
+// Verified code may run unchecked; anything else is still loaded but runs bounds-checked
+static int verify_loaded(VM *vm)
+{
+	Verifier v;
+	int i;
+
+	vm->verified = verify_code(vm->code, vm->code_len, &v);
+	vm->max_depth = 0;
+
+	if(!vm->verified)
+		fprintf(stderr, "Warning: Code not verified (%s at code index %d), running bounds-checked\n",
+			v.error, v.error_pc);
+
+	for(i = 0; i < v.num_procs; i++)
+		if(v.procs[i].max_depth > vm->max_depth) vm->max_depth = v.procs[i].max_depth;
+
+	verify_free(&v);
+	return 1;
+}
+
+int vm_load(VM *vm, FILE *fp)
+{
+	char buff[BUFFLEN];
+	int i = 0, code_len = 0;
+	inst *code;
+
+	// Count the number of instructions
+	while(!feof(fp)) 
+	{
+		if(fgetc(fp) == '\n')
+			code_len++;
+	}
+
+	unload(vm);
+	vm->code_len = code_len;
+	if( !(vm->code = code = calloc(code_len + 1, sizeof(inst))) )
+		return 0;
 
 	// Scan in each instruction
-	for(rewind(fp); fgets(buff, BUFFLEN, fp); i++) 
+	for(rewind(fp); i < code_len && fgets(buff, BUFFLEN, fp); i++) 
 	{
 		if(sscanf(buff, "%d %d %d", &code[i].op, &code[i].l, &code[i].m) != 3) 
 		{
 			fprintf(stderr, "Error: Could not read line %d.\n", i);
 			return 0;
 		}
+	}
 
-		if(code[i].op > 9 || code[i].op < 1)
-		{
-			fprintf(stderr, "Error: Invalid op code '%d' on line %d\n", code[i].op, i);
-			return 0;
-		}
-		else if(code[i].op == 2 && code[i].m > 13)
-		{
-			fprintf(stderr, "Error: Invalid OPR instruction '%d' on line %d.\n", ir.m, pc);
-			return 0;
-		}
+	if(!check_code(code, code_len, 0)) return 0;
+	if(vm->fusion && !fuse_code(vm)) return 0;
+	return verify_loaded(vm) && predecode(vm);
+}
+
+// Map a binary module; the code is used in place, without parsing
+int vm_load_module(VM *vm, const char *path)
+{
+	Module *m;
+
+	if(!(m = module_open(path)))
+	{
+		fprintf(stderr, "Error: %s is not a valid module\n", path);
+		return 0;
 	}
-	return 1;
+
+	unload(vm);
+	vm->module = m;
+	vm->code = m->code;
+	vm->code_len = m->hdr->inst_count;
+
+	// A size given by the user takes precedence
+	if(!vm->stack_size) vm->stack_size = m->hdr->stack_size;
+
+	// A stack left from an earlier run is sized in the old cells
+	if(vm->stack && vm->cell_bits != m->hdr->cell_bits) free_stack(vm);
+	vm->cell_bits = m->hdr->cell_bits;
+
+	if(!check_code(vm->code, vm->code_len, 0)) return 0;
+	if(vm->fusion && !fuse_code(vm)) return 0;
+	return verify_loaded(vm) && predecode(vm);
 }
 
-static const char * const opsym[9] = { 
+const char * const opsym[MAX_OPCODE] = { 
 	"lit", "opr", "lod",
 	"sto", "cal", "inc",
-	"jmp", "jpc", "sio" 
+	"jmp", "jpc", "sio",
+	"llo", "ldo", "rjp",
+	"lst", "cli", "rtn"
 };
 
-void print_input(FILE *out)
+void vm_print_input(VM *vm, FILE *out)
 {
+	const inst *code = vm->code;
 	int i;
 
 	fprintf(out, "%-8s%-8s%-8s%s\n","Line","OP","L","M");
 
-	for(i = 0; i < code_len; i++)
-		fprintf(out, "%-8d%-8s%-8d%d\n", i, opsym[code[i].op-1], code[i].l, code[i].m);
+	for(i = 0; i < vm->code_len; i += inst_width(code[i].op))
+	{
+		fprintf(out, "%-8d%-8s%-8d%d", i, opsym[code[i].op-1], code[i].l, code[i].m);
+
+		// Operand slot of a superinstruction
+		if(inst_width(code[i].op) == 2)
+			fprintf(out, "\t(%d %d %d)", code[i+1].op, code[i+1].l, code[i+1].m);
+		fprintf(out, "\n");
+	}
 	fprintf(out, "\n");
 }
 
-void print_initial_state(FILE *out)
+void print_initial_state(VM *vm, FILE *out)
 {
 	if(!out) return;
 	fprintf(out, "%70s", "pc      bp      sp      stack\n");
-	fprintf(out, "%-40s%-8d%-8d%-8d\n","Initial Values",pc,bp,sp);
+	fprintf(out, "%-40s%-8d%-8d%-8d\n","Initial Values",vm->pc,vm->bp,vm->sp);
 }
 
-void print_state(FILE *out)
+void print_state(VM *vm, FILE *out)
 {
+	int *stack = vm->stack;
 	int i, ari = 0;
 
 	if(!out) return;
 
 	// Print register values
-	fprintf(out, "%-8d%-8d%-8d", pc, bp, sp);
+	fprintf(out, "%-8d%-8d%-8d", vm->pc, vm->bp, vm->sp);
 
 	// Print stack
-	for(i = 1; i <= sp; i++) 
+	for(i = 1; i <= vm->sp; i++) 
 	{
 		fprintf(out, "%d ", stack[i]);
 
-		if(i + 1 == display[ari])
+		if(i + 1 == vm->ar_start[ari])
 		{
 			fprintf(out, "| ");
 			ari++;
@@ -124,117 +515,1011 @@ void print_state(FILE *out)
 	}
 
 	// Print new AR if just created
-	if(sp && (bp - sp == 1)) 
+	if(vm->sp && (vm->bp - vm->sp == 1)) 
 		fprintf(out, "%d %d %d %d ", stack[i], stack[i + 1], stack[i+2], stack[i+3]);
 
 	fprintf(out, "\n");
 }
 
+// Trace the instruction at line before it executes
+void trace_fetch(VM *vm, FILE *out, int line, const inst *i)
+{
+	if(out) 
+		fprintf(out, "%-8d%-8s%-8d%-16d", line, opsym[i->op - 1], i->l, i->m);
+}
+
+// Trace the machine state after the instruction at line has executed
+void trace_state(VM *vm, FILE *out, int line, const inst *i)
+{
+	print_state(vm, out);
+
+	if(vm->recorder) 
+		trace_record(vm->recorder, line, i->op, i->l, i->m, vm->bp, vm->sp, vm->stack[vm->sp]);
+}
+
+/* SIO */
+#define OUTBUF_SIZE (1 << 16)
+
+// Read all of vm->in into vm->input ahead of the run
+static int read_all_input(VM *vm)
+{
+	size_t cap = 1024, len = 0, n;
+	char *text = NULL, *p, *end;
+	long v;
+
+	for(;;)
+	{
+		if( !(p = realloc(text, cap + 1)) )
+		{
+			free(text);
+			return 0;
+		}
+		text = p;
+
+		if((n = fread(text + len, 1, cap - len, vm->in)) == 0) break;
+		if((len += n) == cap) cap *= 2;
+	}
+
+	// Raw input is already in place
+	if(vm->io == IO_RAW)
+	{
+		vm->input = (int *) text;
+		vm->input_len = len / sizeof(int);
+		vm->input_eof = 1;
+		return 1;
+	}
+
+	// Text values are parsed in place; each takes at least two bytes
+	vm->input = malloc((len / 2 + 1) * sizeof(int));
+	text[len] = '\0';
+
+	for(p = text; vm->input; p = end)
+	{
+		v = strtol(p, &end, 10);
+		if(end == p) break;
+		vm->input[vm->input_len++] = v;
+	}
+
+	free(text);
+	vm->input_eof = 1;
+	return vm->input != NULL;
+}
+
+// Queue a value for READ; input_eof ends the stream
+int vm_push_input(VM *vm, int value)
+{
+	int *p;
+
+	if(vm->input_len == vm->input_cap)
+	{
+		if( !(p = realloc(vm->input, (vm->input_cap ? 2 * vm->input_cap : 64) * sizeof(int))) )
+			return 0;
+		vm->input = p;
+		vm->input_cap = vm->input_cap ? 2 * vm->input_cap : 64;
+	}
+
+	vm->input[vm->input_len++] = value;
+	return 1;
+}
+
+// A READ would not block: a value is queued or none will come
+static int input_ready(const VM *vm)
+{
+	return vm->io == IO_INTERACTIVE || vm->input_pos < vm->input_len || vm->input_eof;
+}
+
+static void flush_output(VM *vm)
+{
+	if(vm->out_len) fwrite(vm->outbuf, 1, vm->out_len, vm->out);
+	vm->out_len = 0;
+}
+
+// Takes a cell of any width; raw output is always int32
+static void sio_write(VM *vm, long long v)
+{
+	char digits[22], *d = digits + sizeof(digits);
+	unsigned long long u = (v < 0) ? -(unsigned long long) v : v;
+	int raw = v;
+
+	if(vm->io == IO_INTERACTIVE)
+	{
+		fprintf(vm->out, "%lld\n", v);
+		return;
+	}
+
+	if(vm->out_len > OUTBUF_SIZE - sizeof(digits))
+		flush_output(vm);
+
+	if(vm->io == IO_RAW)
+	{
+		memcpy(vm->outbuf + vm->out_len, &raw, sizeof(raw));
+		vm->out_len += sizeof(raw);
+		return;
+	}
+
+	// Format right to left
+	*--d = '\n';
+	do *--d = '0' + u % 10; while(u /= 10);
+	if(v < 0) *--d = '-';
+
+	memcpy(vm->outbuf + vm->out_len, d, digits + sizeof(digits) - d);
+	vm->out_len += digits + sizeof(digits) - d;
+}
+
+// Past the end of batch input, reads give 0
+static void sio_read(VM *vm, int *cell)
+{
+	if(vm->io == IO_INTERACTIVE)
+	{
+		fprintf(vm->out, "Input an integer value: ");
+		fscanf(vm->in, "%d", cell);
+	}
+	else *cell = (vm->input_pos < vm->input_len) ? vm->input[vm->input_pos++] : 0;
+}
+
 /* Arithmetic/Logical functions */
-void neg(){stack[sp] = -stack[sp];}
-void add(){stack[--sp] += stack[sp+1];}
-void sub(){stack[--sp] -= stack[sp+1];}
-void mul(){stack[--sp] *= stack[sp+1];}
-void dvd(){stack[--sp] /= stack[sp+1];}
-void odd(){stack[sp] %= 2;}
-void mod(){stack[--sp] %= stack[sp+1];}
-void eql(){stack[--sp] = (stack[sp] == stack[sp+1])? 1:0;}
-void neq(){stack[--sp] = (stack[sp] != stack[sp+1])? 1:0;}
-void lss(){stack[--sp] = (stack[sp] < stack[sp+1])? 1:0;}
-void leq(){stack[--sp] = (stack[sp] <= stack[sp+1])? 1:0;}
-void gtr(){stack[--sp] = (stack[sp] > stack[sp+1])? 1:0;}
-void geq(){stack[--sp] = (stack[sp] >= stack[sp+1])? 1:0;}
-void ret()
-{
-	sp = bp - 1;
-	pc = stack[sp + 4];
-	bp = stack[sp + 3];
-	display[--top_ari] = 0;
+#define TOP (vm->stack[vm->sp])
+#define POP (vm->stack[vm->sp--])
+
+void neg(VM *vm){TOP = -TOP;}
+void add(VM *vm){int b = POP; TOP += b;}
+void sub(VM *vm){int b = POP; TOP -= b;}
+void mul(VM *vm){int b = POP; TOP *= b;}
+void dvd(VM *vm){int b = POP; TOP /= b;}
+void odd(VM *vm){TOP %= 2;}
+void mod(VM *vm){int b = POP; TOP %= b;}
+void eql(VM *vm){int b = POP; TOP = (TOP == b)? 1:0;}
+void neq(VM *vm){int b = POP; TOP = (TOP != b)? 1:0;}
+void lss(VM *vm){int b = POP; TOP = (TOP < b)? 1:0;}
+void leq(VM *vm){int b = POP; TOP = (TOP <= b)? 1:0;}
+void gtr(VM *vm){int b = POP; TOP = (TOP > b)? 1:0;}
+void geq(VM *vm){int b = POP; TOP = (TOP >= b)? 1:0;}
+void ret(VM *vm)
+{
+	vm->sp = vm->bp - 1;
+	vm->pc = vm->stack[vm->sp + 4];
+	vm->bp = vm->stack[vm->sp + 3];
+	leave_ar(vm);
+	vm->sp += vm->ret_push[vm->top_ari];
+}
+
+// RTN: the AR's value replaces the n arguments pushed before the call
+void rtn(VM *vm, int n)
+{
+	int v = vm->stack[vm->bp];
+
+	vm->sp = vm->bp - 1 - n;
+	vm->pc = vm->stack[vm->bp + 3];
+	vm->bp = vm->stack[vm->bp + 2];
+	leave_ar(vm);
+	vm->stack[++vm->sp] = v;
+	vm->sp += vm->ret_push[vm->top_ari];
+}
+
+#undef TOP
+#undef POP
+
+// Push a new AR for a call to m, lex levels out
+static void call(VM *vm, int lex, int m, int push)
+{
+	int *stack = vm->stack;
+	unsigned sp = vm->sp;
+
+	stack[sp + 1] = 0;					// Return value
+	stack[sp + 2] = FRAME(lex, vm->bp);	// Static link (parent AR)
+	stack[sp + 3] = vm->bp;				// Dynamic Link (previous AR)
+	stack[sp + 4] = vm->pc;				// Return addr (next code index)
+	enter_ar(vm, lex, sp + 1, push);
+	vm->bp = sp + 1;
+	vm->pc = m;
 }
 
 /* P-Machine execution step */
-int execute()
+int execute(VM *vm)
 {
 	// Arithmetic/Logical jump table
-	static void (* const opr_table[])(void) = { 
+	static void (* const opr_table[])(VM *) = { 
 		ret, neg, add, sub, mul, dvd, odd, 
 		mod, eql, neq, lss, leq, gtr, geq 
 	};
+	const inst ir = vm->ir;
+	const inst *code = vm->code;
+	int *stack = vm->stack;
 	
 	switch(ir.op)
 	{
 		case 1: // LIT
-			stack[++sp] = ir.m;
+			stack[++vm->sp] = ir.m;
 			break;
 		case 2: // OPR
-			opr_table[ir.m]();
+			opr_table[ir.m](vm);
 			break;
 		case 3: // LOD
-			stack[++sp] = stack[base(ir.l, bp) + ir.m];
+			stack[vm->sp + 1] = stack[FRAME(ir.l, vm->bp) + ir.m];
+			vm->sp++;
 			break;
 		case 4: // STO
-			stack[base(ir.l, bp) + ir.m] = stack[sp--];
+			stack[FRAME(ir.l, vm->bp) + ir.m] = stack[vm->sp--];
 			break;
 		case 5: // CAL
-			display[top_ari++] = sp + 1;
-			stack[sp + 1] = 0;				// Return value
-			stack[sp + 2] = base(ir.l, bp);	// Static link (parent AR)
-			stack[sp + 3] = bp;				// Dynamic Link (previous AR)
-			stack[sp + 4] = pc;				// Return addr (next code index)
-			bp = sp + 1;
-			pc = ir.m;
+			call(vm, ir.l, ir.m, 0);
 			break;
 		case 6: // INC
-			sp = sp + ir.m;
+			vm->sp = vm->sp + ir.m;
 			break;
 		case 7: // JMP
-			pc = ir.m;
+			vm->pc = ir.m;
 			break; 
 		case 8: // JPC
-			if(stack[sp--] == 0) pc = ir.m;
+			if(stack[vm->sp--] == 0) vm->pc = ir.m;
 			break;
 		case 9:	// SIO
 			if(ir.m == 1) // WRITE
 			{
-				printf("%d\n", stack[sp--]);
+				sio_write(vm, stack[vm->sp--]);
 			}
 			else if(ir.m == 2) // READ
 			{
-				printf("Input an integer value: ");
-				scanf("%d", &stack[++sp]);
+				sio_read(vm, &stack[++vm->sp]);
 			} 
 			else if(ir.m == 3) // HALT
 			{
-				pc = 0;
-				bp = 0;
-				sp = 0;
+				vm->pc = 0;
+				vm->bp = 0;
+				vm->sp = 0;
 				return 0;
 			} 
 			break;
+		case LLO: // LOD; LIT; OPR
+			stack[vm->sp + 1] = stack[FRAME(ir.l, vm->bp) + ir.m];
+			stack[vm->sp + 2] = code[vm->pc].m;
+			vm->sp += 2;
+			opr_table[code[vm->pc++].op](vm);
+			vm->fused_steps += 2;
+			break;
+		case LDO: // LOD; LOD; OPR
+			stack[vm->sp + 1] = stack[FRAME(ir.l, vm->bp) + ir.m];
+			stack[vm->sp + 2] = stack[FRAME(code[vm->pc].l, vm->bp) + code[vm->pc].m];
+			vm->sp += 2;
+			opr_table[code[vm->pc++].op](vm);
+			vm->fused_steps += 2;
+			break;
+		case RJP: // OPR; JPC
+			opr_table[ir.l](vm);
+			if(stack[vm->sp--] == 0) vm->pc = ir.m;
+			vm->fused_steps++;
+			break;
+		case LST: // LIT; STO
+			stack[FRAME(ir.l, vm->bp) + ir.m] = code[vm->pc++].m;
+			vm->fused_steps++;
+			break;
+		case CLI: // CAL; INC 0 1
+			call(vm, ir.l, ir.m, 1);
+			vm->fused_steps++;
+			break;
+		case RTN:
+			rtn(vm, ir.m);
+			break;
 	}
 	return 1;
 }
 
-void fetch_and_execute(FILE *out)
+/* Switch interpreters */
+
+// Untraced loop over the packed stream, one flat switch with no opr_table calls
+static void switch_run(VM *vm)
 {
+	unsigned pc = vm->pc, bp = vm->bp, sp = vm->sp;
+	int *s = vm->stack;
+	const PackedInst *code = vm->packed, *i;
+	unsigned long long nsteps = 0, nfused = 0;
+	int op, v;
+
+	for(;;)
+	{
+		i = &code[pc++];
+		op = i->op;
+		nsteps++;
+	again:
+		switch(op)
+		{
+			case H_LIT: s[++sp] = i->m; break;
+			case H_LOD: s[sp + 1] = s[FRAME(i->l, bp) + i->m]; sp++; break;
+			case H_STO: s[FRAME(i->l, bp) + i->m] = s[sp--]; break;
+			case H_CAL:
+			case H_CLI:
+				s[sp + 1] = 0;
+				s[sp + 2] = FRAME(i->l, bp);
+				s[sp + 3] = bp;
+				s[sp + 4] = pc;
+				enter_ar(vm, i->l, sp + 1, op == H_CLI);
+				bp = sp + 1;
+				pc = i->m;
+				nfused += op == H_CLI;
+				break;
+			case H_INC: sp += i->m; break;
+			case H_JMP: pc = i->m; break;
+			case H_JPC: if(s[sp--] == 0) pc = i->m; break;
+			case H_NOP: break;
+
+			case H_RET:
+				sp = bp - 1;
+				pc = s[sp + 4];
+				bp = s[sp + 3];
+				leave_ar(vm);
+				sp += vm->ret_push[vm->top_ari];
+				break;
+			case H_RTN:
+				v = s[bp];
+				sp = bp - 1 - i->m;
+				pc = s[bp + 3];
+				bp = s[bp + 2];
+				leave_ar(vm);
+				s[++sp] = v;
+				sp += vm->ret_push[vm->top_ari];
+				break;
+			case H_NEG: s[sp] = -s[sp]; break;
+			case H_ADD: sp--; s[sp] += s[sp + 1]; break;
+			case H_SUB: sp--; s[sp] -= s[sp + 1]; break;
+			case H_MUL: sp--; s[sp] *= s[sp + 1]; break;
+			case H_DVD: sp--; s[sp] /= s[sp + 1]; break;
+			case H_ODD: s[sp] %= 2; break;
+			case H_MOD: sp--; s[sp] %= s[sp + 1]; break;
+			case H_EQL: sp--; s[sp] = s[sp] == s[sp + 1]; break;
+			case H_NEQ: sp--; s[sp] = s[sp] != s[sp + 1]; break;
+			case H_LSS: sp--; s[sp] = s[sp] < s[sp + 1]; break;
+			case H_LEQ: sp--; s[sp] = s[sp] <= s[sp + 1]; break;
+			case H_GTR: sp--; s[sp] = s[sp] > s[sp + 1]; break;
+			case H_GEQ: sp--; s[sp] = s[sp] >= s[sp + 1]; break;
+
+			case H_WRT: sio_write(vm, s[sp--]); break;
+			case H_REA: sio_read(vm, &s[++sp]); break;
+			case H_HLT:
+				pc = bp = sp = 0;
+				vm->run = 0;
+				goto done;
+
+			// Fused operations finish in the handler of their OPR
+			case H_LLO:
+			case H_LDO:
+				s[sp + 1] = s[FRAME(i->l, bp) + i->m];
+				s[sp + 2] = (op == H_LLO) ? i[1].m : s[FRAME(i[1].l, bp) + i[1].m];
+				sp += 2;
+				pc++;
+				nfused += 2;
+				op = i[1].op;
+				goto again;
+			case H_LST:
+				s[FRAME(i->l, bp) + i->m] = i[1].m;
+				pc++;
+				nfused++;
+				break;
+
+			case H_RJP_ODD: nfused++; if(s[sp--] % 2 == 0) pc = i->m; break;
+			case H_RJP_EQL: nfused++; sp -= 2; if(!(s[sp + 1] == s[sp + 2])) pc = i->m; break;
+			case H_RJP_NEQ: nfused++; sp -= 2; if(!(s[sp + 1] != s[sp + 2])) pc = i->m; break;
+			case H_RJP_LSS: nfused++; sp -= 2; if(!(s[sp + 1] < s[sp + 2])) pc = i->m; break;
+			case H_RJP_LEQ: nfused++; sp -= 2; if(!(s[sp + 1] <= s[sp + 2])) pc = i->m; break;
+			case H_RJP_GTR: nfused++; sp -= 2; if(!(s[sp + 1] > s[sp + 2])) pc = i->m; break;
+			case H_RJP_GEQ: nfused++; sp -= 2; if(!(s[sp + 1] >= s[sp + 2])) pc = i->m; break;
+
+			case H_END:
+				nsteps--;	// Fell off the end of the code; nothing executed
+				goto done;
+			default:
+				fprintf(stderr, "Error: Invalid op code '%d' on line %d\n", vm->code[pc - 1].op, pc - 1);
+				goto done;
+		}
+	}
+
+done:
+	vm->pc = pc;
+	vm->bp = bp;
+	vm->sp = sp;
+	vm->steps += nsteps;
+	vm->fused_steps += nfused;
+}
+
+// Reference loop: execute() steps each instruction as loaded
+
+static void switch_run_traced(VM *vm, FILE *out)
+{
+	int line;
+
 	// Print initial state
-	print_initial_state(out);
+	print_initial_state(vm, out);
 
-	while(run)
+	while(vm->run)
 	{
 		// Fetch instruction
-		if(pc < code_len) ir = code[pc++];
+		if(vm->pc < vm->code_len) vm->ir = vm->code[line = vm->pc++];
 		else break;
 
 		// Print Instruction
-		if(out) 
-			fprintf(out, "%-8d%-8s%-8d%-16d", pc - 1, opsym[ir.op - 1], ir.l, ir.m);
+		trace_fetch(vm, out, line, &vm->ir);
 
 		// Execute
-		run = execute();
+		vm->run = execute(vm);
+		vm->steps++;
+
+		trace_state(vm, out, line, &vm->ir);
+	}
+}
+
+// Reference loop with profile hooks around every instruction
+static void switch_run_profiled(VM *vm, FILE *out)
+{
+	Profile *p = vm->profile;
+	int line;
+
+	print_initial_state(vm, out);
+
+	while(vm->run && vm->pc < vm->code_len)
+	{
+		vm->ir = vm->code[line = vm->pc++];
+		trace_fetch(vm, out, line, &vm->ir);
+		profile_step(p, line, &vm->ir);
+
+		vm->run = execute(vm);
+		vm->steps++;
+
+		if(vm->ir.op == 5 || vm->ir.op == CLI) profile_enter(p, vm->ir.m);
+		else if((vm->ir.op == 2 && vm->ir.m == 0) || vm->ir.op == RTN) profile_leave(p);
+
+		trace_state(vm, out, line, &vm->ir);
+	}
+
+	profile_finish(p);
+}
+
+/* Bounds-checked loop for code that failed verification */
+
+// Stack index of cell m of the AR l levels out, or -1 if it is off the stack
+static long checked_cell(VM *vm, int l, int m)
+{
+	long b = vm->bp;
+
+#ifdef WALK_STATIC_LINKS
+	for(; l > 0; l--)
+	{
+		if(b < 0 || b + 1 >= vm->stack_size) return -1;
+		b = vm->stack[b + 1];
+	}
+#else
+	if(l < 0 || l > vm->level) return -1;
+	b = vm->display[vm->level - l];
+#endif
+
+	b += m;
+	return (b >= 0 && b < vm->stack_size) ? b : -1;
+}
 
-		print_state(out);
+// Whether vm->ir, fetched from pc, stays on the stack and in the VM's tables
+static int check_step(VM *vm)
+{
+	const inst *i = &vm->ir;
+	const inst *slot = (vm->pc + 1 < vm->code_len) ? &vm->code[vm->pc + 1] : NULL;
+	long sp = vm->sp, size = vm->stack_size;
+	int pop = 0, push = 0, ok = 1;
+
+	switch(i->op)
+	{
+		case 1: // LIT
+			push = 1;
+			break;
+		case 2: // OPR
+			if(i->m == 0) ok = vm->top_ari > 0 && vm->bp > 0 && vm->bp + 3 < size;
+			else pop = (i->m == 1 || i->m == 6) ? 1 : 2;
+			break;
+		case RTN:
+			ok = vm->top_ari > 0 && vm->bp > 0 && vm->bp + 3 < size && i->m >= 0 && i->m < vm->bp;
+			break;
+		case 3: // LOD
+			ok = checked_cell(vm, i->l, i->m) >= 0;
+			push = 1;
+			break;
+		case 4: // STO
+			ok = checked_cell(vm, i->l, i->m) >= 0;
+			pop = 1;
+			break;
+		case 5: // CAL
+		case CLI:
+			ok = i->l >= 0 && i->l <= vm->level && vm->level - i->l + 1 < MAX_LEXI_LEVELS
+				&& checked_cell(vm, i->l, 0) >= 0;
+			push = 4;
+			break;
+		case 6: // INC
+			ok = sp + i->m >= 0 && sp + i->m < size;
+			break;
+		case 8: // JPC
+			pop = 1;
+			break;
+		case 9: // SIO
+			if(i->m == 1) pop = 1;
+			else if(i->m == 2) push = 1;
+			break;
+		case LLO:
+		case LDO:
+			ok = slot && slot->op >= 1 && slot->op <= 13 && checked_cell(vm, i->l, i->m) >= 0
+				&& (i->op == LLO || checked_cell(vm, slot->l, slot->m) >= 0);
+			push = 2;
+			break;
+		case RJP:
+			ok = i->l >= 1 && i->l <= 13;
+			pop = (i->l == 1 || i->l == 6) ? 1 : 2;
+			break;
+		case LST:
+			ok = slot && checked_cell(vm, i->l, i->m) >= 0;
+			break;
 	}
+
+	if(ok && sp >= pop - 1 && sp + push < size)
+		return 1;
+
+	fprintf(stderr, "Error: Bounds check failed at code index %u\n", vm->pc);
+	return 0;
+}
+
+static void switch_run_checked(VM *vm, FILE *out)
+{
+	int traced = out || vm->recorder;
+	int line;
+
+	if(traced) print_initial_state(vm, out);
+
+	while(vm->run && vm->pc < vm->code_len)
+	{
+		vm->ir = vm->code[line = vm->pc];
+		if(!check_step(vm))
+		{
+			vm->run = 0;
+			break;
+		}
+		vm->pc++;
+
+		if(traced) trace_fetch(vm, out, line, &vm->ir);
+		vm->run = execute(vm);
+		vm->steps++;
+		if(traced) trace_state(vm, out, line, &vm->ir);
+	}
+}
+
+#if defined(__GNUC__)
+
+#define THREADED_NAME threaded_run
+#define THREADED_TRACE 0
+#include "threaded.h"
+
+#define THREADED_NAME threaded_run_traced
+#define THREADED_TRACE 1
+#include "threaded.h"
+
+#define THREADED_NAME threaded_run16
+#define THREADED_TRACE 0
+#define THREADED_CELL int16_t
+#define THREADED_UCELL uint16_t
+#include "threaded.h"
+
+#define THREADED_NAME threaded_run64
+#define THREADED_TRACE 0
+#define THREADED_CELL int64_t
+#define THREADED_UCELL uint64_t
+#include "threaded.h"
+
+#define TOS_NAME tos_run
+#define TOS_TRACE 0
+#include "tos.h"
+
+#define TOS_NAME tos_run_traced
+#define TOS_TRACE 1
+#include "tos.h"
+
+#endif
+
+// Runs one CAL, RET or SIO on behalf of JIT code; returns the next pc, or -1 once halted
+static int jit_exec(void *ctx, int op, int l, int m, int next)
+{
+	VM *vm = ctx;
+
+	vm->ir.op = op;
+	vm->ir.l = l;
+	vm->ir.m = m;
+	vm->pc = next;
+
+	if(!(vm->run = execute(vm))) return -1;
+	return vm->pc;
+}
+
+// Compile and run native code; returns 0 if the program cannot be compiled
+static int jit_fetch_and_execute(VM *vm)
+{
+	JitState st = { vm, vm->stack, &vm->sp, &vm->bp, &vm->pc, jit_exec };
+
+	if(!(vm->jit = jit_compile(vm->code, vm->code_len, &st)))
+		return 0;
+
+	if(vm->run && vm->pc < vm->code_len) jit_run(vm->jit, vm->pc);
+	return 1;
+}
+
+static const char * const engine_names[] = { "switch", "threaded", "tos", "jit" };
+
+// Returns the engine called name, or -1 if there is none
+int engine_by_name(const char *name)
+{
+	int e;
+
+	for(e = 0; e < sizeof(engine_names) / sizeof(engine_names[0]); e++)
+		if(strcmp(engine_names[e], name) == 0) return e;
+	return -1;
+}
+
+// Allocate the stack and batch I/O buffers on first use and arm the overflow handler
+static int prepare_run(VM *vm)
+{
+	static struct sigaction fault_action;
+
+	if(!vm->stack && !alloc_stack(vm))
+	{
+		fprintf(stderr, "Error: Could not allocate a stack of %u cells\n", vm->stack_size);
+		return 0;
+	}
+
+	if(vm->io != IO_INTERACTIVE && !vm->outbuf && !(vm->outbuf = malloc(OUTBUF_SIZE)))
+	{
+		fprintf(stderr, "Error: Could not buffer program output\n");
+		return 0;
+	}
+
+	// Without an input stream, the host feeds values with vm_push_input()
+	if(vm->io != IO_INTERACTIVE && vm->in && !vm->input_eof && !read_all_input(vm))
+	{
+		fprintf(stderr, "Error: Could not buffer program input\n");
+		return 0;
+	}
+
+	// Installed once; the handler looks up the VM running on the faulting thread
+	if(!fault_action.sa_sigaction)
+	{
+		fault_action.sa_sigaction = on_fault;
+		fault_action.sa_flags = SA_SIGINFO;
+		sigaction(SIGSEGV, &fault_action, NULL);
+	}
+	return 1;
+}
+
+/*
+	Run at most budget instructions on the reference loop and return a
+	VM_* status. A READ that would block is left unexecuted at pc, so the
+	next slice retries it once input has been pushed or input_eof set.
+	Output is flushed whenever the program halts or blocks. Steps are
+	traced to trace, if not NULL, and to the recorder like vm_run().
+*/
+int vm_run_slice(VM *vm, unsigned long long budget, FILE *trace)
+{
+	int status = VM_PREEMPTED, traced = trace || vm->recorder, line;
+
+	if(!vm->run || vm->pc >= vm->code_len)
+		return VM_HALTED;
+
+	if(vm->cell_bits != 32)
+	{
+		fprintf(stderr, "Error: Running in slices needs 32-bit cells\n");
+		vm->run = 0;
+		return VM_HALTED;
+	}
+
+	if(!prepare_run(vm))
+	{
+		vm->run = 0;
+		return VM_HALTED;
+	}
+
+	// The initial state heads the trace of the first slice
+	if(vm->steps == 0 && budget) print_initial_state(vm, trace);
+
+	running = vm;
+	if(sigsetjmp(vm->fault, 1))
+	{
+		fprintf(stderr, "Error: Stack overflow (%u cells)\n", vm->stack_size);
+		vm->run = 0;
+	}
+	else
+	{
+		for(; budget; budget--)
+		{
+			if(!vm->run || vm->pc >= vm->code_len)
+				break;
+
+			vm->ir = vm->code[vm->pc];
+			if(vm->ir.op == 9 && vm->ir.m == 2 && !input_ready(vm))
+			{
+				status = VM_BLOCKED;
+				break;
+			}
+			if(!vm->verified && !check_step(vm))
+			{
+				vm->run = 0;
+				break;
+			}
+
+			line = vm->pc++;
+			if(traced) trace_fetch(vm, trace, line, &vm->ir);
+			vm->run = execute(vm);
+			vm->steps++;
+			if(traced) trace_state(vm, trace, line, &vm->ir);
+		}
+	}
+	running = NULL;
+
+	if(!vm->run || vm->pc >= vm->code_len)
+		status = VM_HALTED;
+	if(status != VM_PREEMPTED)
+		flush_output(vm);
+	if(status == VM_HALTED && vm->recorder)
+		vm->recorder->hdr->final_pc = vm->pc;
+	return status;
+}
+
+/*
+	16- and 64-bit cells have their own builds of the untraced threaded
+	loop and nothing else, whatever the engine; the bounds-checked loop
+	only knows 32-bit cells, so such code must verify.
+*/
+static int cells_runnable(VM *vm, int traced)
+{
+#if !defined(__GNUC__)
+	fprintf(stderr, "Error: %d-bit cells need a GCC or Clang build\n", vm->cell_bits);
+	return 0;
+#endif
+	if(!vm->verified)
+	{
+		fprintf(stderr, "Error: Code must verify to run with %d-bit cells\n", vm->cell_bits);
+		return 0;
+	}
+
+	// Return addresses are cells too
+	if(vm->cell_bits == 16 && vm->code_len > 0xffff)
+	{
+		fprintf(stderr, "Error: Code too long for 16-bit cells\n");
+		return 0;
+	}
+
+	if(traced || vm->profile)
+		fprintf(stderr, "Warning: Tracing and profiling need 32-bit cells, running untraced\n");
+	return 1;
+}
+
+// Runs the program; with no text trace and no recorder the loop does no tracing at all
+void vm_run(VM *vm, FILE *out)
+{
+	int traced = out || vm->recorder;
+	int engine = vm->engine;
+
+	if(vm->cell_bits != 32 && !cells_runnable(vm, traced))
+		return;
+
+	if(!prepare_run(vm))
+		return;
+
+	running = vm;
+	if(sigsetjmp(vm->fault, 1))
+	{
+		fprintf(stderr, "Error: Stack overflow (%u cells)\n", vm->stack_size);
+		vm->run = 0;
+	}
+#if defined(__GNUC__)
+	else if(vm->cell_bits == 16)
+		threaded_run16(vm, NULL);
+	else if(vm->cell_bits == 64)
+		threaded_run64(vm, NULL);
+#endif
+	else if(!vm->verified)
+		switch_run_checked(vm, out);
+	// Profiling overrides the engine
+	else if(vm->profile)
+		switch_run_profiled(vm, out);
+	// JIT code is not traced; anything it cannot compile runs interpreted
+	else if(engine != JIT_ENGINE || traced || !jit_fetch_and_execute(vm))
+	{
+		if(engine == JIT_ENGINE) engine = THREADED_ENGINE;
+
+#if defined(__GNUC__)
+		if(engine == THREADED_ENGINE)
+		{
+			if(traced) threaded_run_traced(vm, out);
+			else threaded_run(vm, out);
+		}
+		else if(engine == TOS_ENGINE)
+		{
+			if(traced) tos_run_traced(vm, out);
+			else tos_run(vm, out);
+		}
+		else
+#endif
+		if(traced) switch_run_traced(vm, out);
+		else switch_run(vm);
+	}
+	running = NULL;
+	flush_output(vm);
+
+	jit_free(vm->jit);
+	vm->jit = NULL;
+
+	if(vm->recorder) vm->recorder->hdr->final_pc = vm->pc;
+}
+
+/* Snapshots: the loaded code as a module carrying a MODULE_STATE chunk */
+
+// Cells that must be saved: arguments are pushed below the AR they are passed to, so
+// all are under sp, but a STO 0 m of hand-written code may reach above it
+static uint32_t live_cells(const VM *vm)
+{
+	unsigned top = vm->sp;
+	int i, reach = 0;
+
+	for(i = 0; i < vm->code_len; i++)
+		if((vm->code[i].op == 4 || vm->code[i].op == LST) && vm->code[i].l == 0 && vm->code[i].m > reach)
+			reach = vm->code[i].m;
+
+	if(vm->bp + reach > top) top = vm->bp + reach;
+	return (top < vm->stack_size) ? top + 1 : vm->stack_size;
+}
+
+/*
+	Write the state of a run suspended between instructions to path. Output
+	is flushed first, so everything the program wrote before the snapshot
+	is on disk; the file is replaced atomically.
+*/
+int vm_save(VM *vm, const char *path)
+{
+	char tmp[FILENAME_MAX];
+	unsigned char *debug = NULL, *data;
+	uint32_t debug_size = 0, size, n;
+	const uint32_t tags[] = { MODULE_LINES, MODULE_PROCS };
+	const void *chunk;
+	ModuleState st;
+	FILE *fp;
+	int i, ok;
+
+	if(!vm->stack) return 0;
+
+	flush_output(vm);
+	fflush(vm->out);
+
+	memset(&st, 0, sizeof(st));
+	st.bp = vm->bp;
+	st.sp = vm->sp;
+	st.pc = vm->pc;
+	st.level = vm->level;
+	st.top_ari = vm->top_ari;
+	st.stack_len = live_cells(vm);
+	st.io = vm->io;
+	st.fusion = vm->fusion;
+	st.input_pos = vm->input_pos;
+	st.out_pos = ftello(vm->out);
+	st.steps = vm->steps;
+	st.fused_steps = vm->fused_steps;
+
+	size = sizeof(st) + (st.stack_len + st.level + 1 + 4 * st.top_ari) * sizeof(int);
+	if(!(data = malloc(size)))
+		return 0;
+
+	memcpy(data, &st, sizeof(st));
+	n = sizeof(st);
+	memcpy(data + n, vm->stack, st.stack_len * sizeof(int)); n += st.stack_len * sizeof(int);
+	memcpy(data + n, vm->display, (st.level + 1) * sizeof(int)); n += (st.level + 1) * sizeof(int);
+	memcpy(data + n, vm->ar_start, st.top_ari * sizeof(int)); n += st.top_ari * sizeof(int);
+	memcpy(data + n, vm->saved_level, st.top_ari * sizeof(int)); n += st.top_ari * sizeof(int);
+	memcpy(data + n, vm->saved_display, st.top_ari * sizeof(int)); n += st.top_ari * sizeof(int);
+	memcpy(data + n, vm->ret_push, st.top_ari * sizeof(int));
+
+	debug = module_add_section(NULL, &debug_size, MODULE_STATE, data, size);
+	free(data);
+
+	// Keep the debug info of the module the code came from
+	for(i = 0; debug && vm->module && i < sizeof(tags) / sizeof(tags[0]); i++)
+		if((chunk = module_section(vm->module, tags[i], &size)))
+			debug = module_add_section(debug, &debug_size, tags[i], chunk, size);
+
+	if(!debug) return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if(!(fp = fopen(tmp, "wb")))
+	{
+		free(debug);
+		return 0;
+	}
+
+	ok = module_write(fp, (const int (*)[3]) vm->code, vm->code_len, vm->stack_size, vm->cell_bits, debug, debug_size);
+	ok = (fclose(fp) == 0) && ok && rename(tmp, path) == 0;
+	if(!ok) remove(tmp);
+
+	free(debug);
+	return ok;
+}
+
+/*
+	Load a snapshot written by vm_save(). The code is used in place from
+	the mapped file; the saved stack cells are copied into a fresh stack of
+	at least the saved size. The run continues in the I/O mode it was
+	started in, past the input it had consumed. If vm->out is a file that
+	has grown beyond the output at the time of the snapshot, it is cut back
+	so the resumed run writes exactly what an uninterrupted one would.
+*/
+int vm_resume(VM *vm, const char *path)
+{
+	const unsigned char *p;
+	ModuleState st;
+	uint32_t size;
+	Module *m;
+	int fd;
+
+	// Runs are only sliced, and so snapshotted, with 32-bit cells
+	if(!(m = module_open(path)) || !(p = module_section(m, MODULE_STATE, &size)) || size < sizeof(st)
+		|| m->hdr->cell_bits != 32)
+	{
+		fprintf(stderr, "Error: %s is not a valid snapshot\n", path);
+		module_close(m);
+		return 0;
+	}
+	memcpy(&st, p, sizeof(st));
+
+	unload(vm);
+	free_stack(vm);
+	vm->module = m;
+	vm->code = m->code;
+	vm->code_len = m->hdr->inst_count;
+	vm->cell_bits = m->hdr->cell_bits;
+
+	if(vm->stack_size < m->hdr->stack_size) vm->stack_size = m->hdr->stack_size;
+
+	if(!check_code(vm->code, vm->code_len, st.fusion)) return 0;
+
+	if(!alloc_stack(vm))
+	{
+		fprintf(stderr, "Error: Could not allocate a stack of %u cells\n", vm->stack_size);
+		return 0;
+	}
+
+	if(st.stack_len > vm->stack_size || st.sp >= vm->stack_size || st.bp >= vm->stack_size
+		|| st.level < 0 || st.level >= MAX_LEXI_LEVELS
+		|| st.top_ari < 0 || st.top_ari >= vm->max_frames
+		|| size != sizeof(st) + (st.stack_len + st.level + 1 + 4 * (uint32_t) st.top_ari) * sizeof(int))
+	{
+		fprintf(stderr, "Error: %s is not a valid snapshot\n", path);
+		return 0;
+	}
+
+	p += sizeof(st);
+	memcpy(vm->stack, p, st.stack_len * sizeof(int)); p += st.stack_len * sizeof(int);
+	memcpy(vm->display, p, (st.level + 1) * sizeof(int)); p += (st.level + 1) * sizeof(int);
+	memcpy(vm->ar_start, p, st.top_ari * sizeof(int)); p += st.top_ari * sizeof(int);
+	memcpy(vm->saved_level, p, st.top_ari * sizeof(int)); p += st.top_ari * sizeof(int);
+	memcpy(vm->saved_display, p, st.top_ari * sizeof(int)); p += st.top_ari * sizeof(int);
+	memcpy(vm->ret_push, p, st.top_ari * sizeof(int));
+
+	vm->bp = st.bp;
+	vm->sp = st.sp;
+	vm->pc = st.pc;
+	vm->level = st.level;
+	vm->top_ari = st.top_ari;
+	vm->io = st.io;
+	vm->fusion = st.fusion;
+	vm->input_pos = st.input_pos;
+	vm->steps = st.steps;
+	vm->fused_steps = st.fused_steps;
+	vm->run = 1;
+	verify_loaded(vm);
+	if(!predecode(vm)) return 0;
+
+	fd = fileno(vm->out);
+	if(st.out_pos >= 0 && lseek(fd, 0, SEEK_END) > st.out_pos)
+	{
+		fflush(vm->out);
+		if(ftruncate(fd, st.out_pos) == 0) fseeko(vm->out, st.out_pos, SEEK_SET);
+	}
+	return 1;
 }
 
 // int main(int argc, char **argv)
@@ -265,4 +1550,4 @@ void fetch_and_execute(FILE *out)
 
 // 	fclose(fp);
 // 	return 1;
-// }
\ No newline at end of file
+// }
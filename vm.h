@@ -1,13 +1,142 @@
 #ifndef VM_H
 #define VM_H
 
-#define MAX_STACK_HEIGHT 2000
-#define MAX_INST_COUNT 32768
-//#define MAX_LEXI_LEVELS 3
+#include <stdio.h>
+#include <stdint.h>
+#include <setjmp.h>
 
-int read_input(FILE *in);
-void print_input(FILE *out);
-void fetch_and_execute(FILE *out);
+#define DEFAULT_STACK_HEIGHT (1 << 16)	// Cells, when neither the module nor the user sets it
+#define MAX_LEXI_LEVELS 500
+#define MAX_OPCODE 15	// Opcodes 10 to 14 are superinstructions
 
+/*
+	RTN 0 n returns from a procedure called with n arguments pushed before
+	its CAL: the arguments are popped and the AR's return value is left on
+	the caller's stack top. Parameters sit below the AR, at offsets -n to -1.
+*/
+#define RTN 15
 
-#endif 
\ No newline at end of file
+/* Superinstructions produced by fuse_code() */
+#define LLO 10	// LOD l a; LIT 0 k; OPR 0 op	-> LLO l a, {op 0 k}
+#define LDO 11	// LOD l a; LOD l' a'; OPR 0 op	-> LDO l a, {op l' a'}
+#define RJP 12	// OPR 0 rel; JPC 0 t			-> RJP rel t
+#define LST 13	// LIT 0 k; STO l a				-> LST l a, {0 0 k}
+#define CLI 14	// CAL l a; INC 0 1				-> CLI l a
+
+typedef struct instruction {
+	unsigned op;
+	int l;
+	int m;
+} inst;
+
+/* Pre-decoded instruction the fast engines run; see predecode() */
+typedef struct PackedInst {
+	uint16_t op;	// Handler, with OPR, SIO and RJP sub-ops expanded
+	uint16_t l;
+	int32_t m;
+} PackedInst;
+
+/* Dispatch engines */
+#define SWITCH_ENGINE 0		// Reference switch interpreter
+#define THREADED_ENGINE 1	// Computed-goto direct threading (GCC/Clang)
+#define TOS_ENGINE 2		// Threaded with the top of stack cached in a register
+#define JIT_ENGINE 3		// x86-64 template JIT, falls back to THREADED_ENGINE
+
+/* SIO modes */
+#define IO_INTERACTIVE 0	// Prompt and scan per READ, printf per WRITE
+#define IO_BUFFERED 1		// Text integers, pre-read and without prompts
+#define IO_RAW 2			// Native int32 values in both directions, whatever the cell width
+
+/* vm_run_slice() results */
+#define VM_HALTED 0
+#define VM_PREEMPTED 1		// Budget used up
+#define VM_BLOCKED 2		// At a READ with no input yet
+
+#ifndef DEFAULT_ENGINE
+#define DEFAULT_ENGINE SWITCH_ENGINE
+#endif
+
+struct Trace;
+struct Module;
+struct Jit;
+struct Profile;
+
+/* A P-Machine instance; everything a running program touches lives here */
+typedef struct VM {
+	/* CPU Registers */
+	unsigned bp;
+	unsigned sp;
+	unsigned pc;
+	inst ir;
+
+	/* Memory Stores */
+	int code_len;
+	inst *code;
+	struct Module *module;	// Backs code when loaded from a module
+	PackedInst *packed;		// code pre-decoded, code_len + 1 entries
+	int *stack;				// Followed by a guard page; cells are cell_bits wide
+	unsigned stack_size;	// Cells; 0 takes the module's size or the default
+	int cell_bits;			// 32, or 16/64 for the specialized threaded loops
+	size_t stack_map_len;
+
+	/* Per-call records, max_frames deep */
+	int top_ari;
+	int max_frames;
+	int *ar_start;
+	int *saved_level;
+	int *saved_display;
+	int *ret_push;			// Push return value on RET (CLI)
+
+	/* Display: base of the active AR at each lexical level */
+	int level;
+	int display[MAX_LEXI_LEVELS];
+
+	/* SIO streams */
+	FILE *in;
+	FILE *out;
+	int io;					// IO_* mode
+
+	/* Batch I/O: all input read up front, output flushed in bulk */
+	int *input;
+	size_t input_len;
+	size_t input_pos;
+	size_t input_cap;		// Of input, when fed with vm_push_input()
+	int input_eof;			// No values will follow input[input_len - 1]
+	char *outbuf;
+	size_t out_len;
+
+	/* Flags */
+	int run;
+	int fusion;
+	int engine;
+	int verified;			// Passed verify_code(); other code runs bounds-checked
+	struct Trace *recorder;	// Binary trace recorder
+	struct Profile *profile;	// Run the profiled loop and count into this
+
+	/* Per-run engine state, released by vm_run() even after a fault */
+	struct Jit *jit;
+	sigjmp_buf fault;		// Stack overflow recovery
+
+	/* Statistics */
+	unsigned long long steps;		// Instructions dispatched
+	unsigned long long fused_steps;	// Dispatches saved by superinstructions
+	int max_depth;					// Deepest procedure frame, in cells, if verified
+} VM;
+
+extern const char * const opsym[];
+
+VM *vm_create();
+int vm_load(VM *vm, FILE *in);
+int vm_load_module(VM *vm, const char *path);
+void vm_run(VM *vm, FILE *trace);
+int vm_run_slice(VM *vm, unsigned long long budget, FILE *trace);
+int vm_push_input(VM *vm, int value);
+int vm_save(VM *vm, const char *path);
+int vm_resume(VM *vm, const char *path);
+void vm_destroy(VM *vm);
+
+void vm_print_input(VM *vm, FILE *out);
+int engine_by_name(const char *name);
+
+
+#endif